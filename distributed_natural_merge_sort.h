@@ -0,0 +1,803 @@
+#ifndef DISTRIBUTED_NATURAL_MERGE_SORT_H
+#define DISTRIBUTED_NATURAL_MERGE_SORT_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+#ifdef NATURAL_MERGE_SORT_MPI
+#include <climits>
+#include <stdexcept>
+
+#include <mpi.h>
+#endif
+
+#include "parallel_natural_merge_sort.h"
+
+/*******************************************************************************
+* Collects the options of the distributed natural merge sort.                  *
+*******************************************************************************/
+struct DistributedSortOptions {
+
+    // The amount of samples every node contributes per node for choosing
+    // the splitters. More samples balance the partitions better at the cost
+    // of a larger gather.
+    size_t oversampling;
+
+    // Whether to skip the exchange when the locally sorted data is already
+    // partitioned by range over the nodes in rank order and no node holds
+    // more than 'presorted_imbalance' times the mean amount of elements.
+    bool presorted_fast_path;
+    double presorted_imbalance;
+
+    // The options of the node-local 'parallel_natural_merge_sort'.
+    NaturalMergeSortOptions sort_options;
+
+    DistributedSortOptions() :
+    oversampling{64},
+    presorted_fast_path{true},
+    presorted_imbalance{1.25}
+    {}
+};
+
+/*******************************************************************************
+* The collective operations the distributed sort needs from the interconnect.  *
+* Every node of the sort calls the operations in the same order. The data is   *
+* moved as raw bytes, so the sorted type must be trivially copyable.           *
+*******************************************************************************/
+class DistributedTransport {
+public:
+
+    virtual ~DistributedTransport() {}
+
+    /***************************************************************************
+    * Returns the rank of this node, which is less than 'size()'.              *
+    ***************************************************************************/
+    virtual size_t rank() const = 0;
+
+    /***************************************************************************
+    * Returns the amount of nodes.                                             *
+    ***************************************************************************/
+    virtual size_t size() const = 0;
+
+    /***************************************************************************
+    * Sends the 'bytes' bytes at 'data' to every node, and receives the block  *
+    * of the node of rank 'r' at 'received + r * bytes'. Every node passes the *
+    * same 'bytes'.                                                            *
+    ***************************************************************************/
+    virtual void allGather(const void* data,
+                           size_t bytes,
+                           void* received) = 0;
+
+    /***************************************************************************
+    * Sends the 'send_bytes[r]' bytes at 'send + send_offsets[r]' to the node  *
+    * of rank 'r', and receives the block of the node of rank 'r' at           *
+    * 'receive + receive_offsets[r]', which has 'receive_bytes[r]' bytes.      *
+    * Calls 'on_received(r)' on the calling thread as soon as the block of the *
+    * node of rank 'r' is in place, so the caller may work on it while the     *
+    * other blocks are still arriving. Every block is reported exactly once.   *
+    ***************************************************************************/
+    virtual void allToAll(const char* send,
+                          const size_t* send_offsets,
+                          const size_t* send_bytes,
+                          char* receive,
+                          const size_t* receive_offsets,
+                          const size_t* receive_bytes,
+                          const std::function<void(size_t)>& on_received)
+                          = 0;
+};
+
+/*******************************************************************************
+* Connects the nodes of a distributed sort that run as threads of a single     *
+* process. Every node thread uses its own 'ThreadTransport' of the hub.        *
+*******************************************************************************/
+class ThreadTransportHub {
+private:
+
+    struct node_slot {
+        const char* send;
+        const size_t* send_offsets;
+        const size_t* send_bytes;
+    };
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::vector<node_slot> m_slots;
+    size_t m_arrived;
+    size_t m_generation;
+
+    friend class ThreadTransport;
+
+    /***************************************************************************
+    * Blocks until all the nodes have called this.                             *
+    ***************************************************************************/
+    void barrier()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        const size_t generation = m_generation;
+
+        if (++m_arrived == m_slots.size())
+        {
+            m_arrived = 0;
+            ++m_generation;
+            m_condition.notify_all();
+            return;
+        }
+
+        m_condition.wait(lock, [this, generation]
+        {
+            return m_generation != generation;
+        });
+    }
+
+public:
+
+    explicit ThreadTransportHub(const size_t nodes) :
+    m_slots(std::max((size_t) 1, nodes)),
+    m_arrived{0},
+    m_generation{0}
+    {}
+
+    ThreadTransportHub(const ThreadTransportHub&) = delete;
+    ThreadTransportHub& operator=(const ThreadTransportHub&) = delete;
+
+    size_t size() const
+    {
+        return m_slots.size();
+    }
+};
+
+/*******************************************************************************
+* The transport of the node of rank 'rank' of a 'ThreadTransportHub'. Every    *
+* node copies the blocks sent to it from the memory of the sending nodes.      *
+*******************************************************************************/
+class ThreadTransport : public DistributedTransport {
+private:
+
+    ThreadTransportHub& m_hub;
+    const size_t m_rank;
+
+public:
+
+    ThreadTransport(ThreadTransportHub& hub, const size_t rank) :
+    m_hub(hub),
+    m_rank{rank}
+    {}
+
+    size_t rank() const override
+    {
+        return m_rank;
+    }
+
+    size_t size() const override
+    {
+        return m_hub.size();
+    }
+
+    void allGather(const void* data,
+                   const size_t bytes,
+                   void* received) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_hub.m_mutex);
+            m_hub.m_slots[m_rank].send = static_cast<const char*>(data);
+        }
+
+        m_hub.barrier();
+
+        for (size_t source = 0; source != size(); ++source)
+        {
+            if (bytes != 0)
+            {
+                std::memcpy(static_cast<char*>(received) + source * bytes,
+                            m_hub.m_slots[source].send,
+                            bytes);
+            }
+        }
+
+        // No node may leave before the others have read its data.
+        m_hub.barrier();
+    }
+
+    void allToAll(const char* send,
+                  const size_t* send_offsets,
+                  const size_t* send_bytes,
+                  char* receive,
+                  const size_t* receive_offsets,
+                  const size_t* receive_bytes,
+                  const std::function<void(size_t)>& on_received) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_hub.m_mutex);
+            ThreadTransportHub::node_slot& slot = m_hub.m_slots[m_rank];
+            slot.send = send;
+            slot.send_offsets = send_offsets;
+            slot.send_bytes = send_bytes;
+        }
+
+        m_hub.barrier();
+
+        // Start from the next rank, so that the nodes read from different
+        // nodes at a time.
+        for (size_t step = 0; step != size(); ++step)
+        {
+            const size_t source = (m_rank + 1 + step) % size();
+            const ThreadTransportHub::node_slot& slot = m_hub.m_slots[source];
+
+            if (receive_bytes[source] != 0)
+            {
+                std::memcpy(receive + receive_offsets[source],
+                            slot.send + slot.send_offsets[m_rank],
+                            receive_bytes[source]);
+            }
+
+            on_received(source);
+        }
+
+        m_hub.barrier();
+    }
+};
+
+#ifdef NATURAL_MERGE_SORT_MPI
+/*******************************************************************************
+* The transport of the calling process in the MPI communicator 'comm'. The     *
+* transport communicates on a duplicate of the communicator, so its messages   *
+* never match those of the application. The blocks of the exchange are         *
+* received with nonblocking receives, and reported in the order they           *
+* complete. Throws 'std::length_error' if a block is larger than an MPI count  *
+* can describe. Constructing and destroying the transport are collective, and  *
+* the transport must be destroyed before 'MPI_Finalize'.                       *
+*******************************************************************************/
+class MpiTransport : public DistributedTransport {
+private:
+
+    // The tag of the messages of the exchange, which are the only ones on the
+    // duplicated communicator. MPI guarantees only the tags up to 32767.
+    static constexpr int EXCHANGE_TAG = 0;
+
+    MPI_Comm m_comm;
+    int m_rank;
+    int m_size;
+
+    static int to_count(const size_t bytes)
+    {
+        if (bytes > (size_t) INT_MAX)
+        {
+            throw std::length_error("The block is too large for MPI.");
+        }
+
+        return (int) bytes;
+    }
+
+public:
+
+    explicit MpiTransport(MPI_Comm comm = MPI_COMM_WORLD)
+    {
+        MPI_Comm_dup(comm, &m_comm);
+        MPI_Comm_rank(m_comm, &m_rank);
+        MPI_Comm_size(m_comm, &m_size);
+    }
+
+    MpiTransport(const MpiTransport&) = delete;
+    MpiTransport& operator=(const MpiTransport&) = delete;
+
+    ~MpiTransport()
+    {
+        MPI_Comm_free(&m_comm);
+    }
+
+    size_t rank() const override
+    {
+        return m_rank;
+    }
+
+    size_t size() const override
+    {
+        return m_size;
+    }
+
+    void allGather(const void* data,
+                   const size_t bytes,
+                   void* received) override
+    {
+        MPI_Allgather(const_cast<void*>(data),
+                      to_count(bytes),
+                      MPI_BYTE,
+                      received,
+                      to_count(bytes),
+                      MPI_BYTE,
+                      m_comm);
+    }
+
+    void allToAll(const char* send,
+                  const size_t* send_offsets,
+                  const size_t* send_bytes,
+                  char* receive,
+                  const size_t* receive_offsets,
+                  const size_t* receive_bytes,
+                  const std::function<void(size_t)>& on_received) override
+    {
+        std::vector<MPI_Request> receives(m_size);
+        std::vector<MPI_Request> sends(m_size);
+
+        for (int node = 0; node != m_size; ++node)
+        {
+            MPI_Irecv(receive + receive_offsets[node],
+                      to_count(receive_bytes[node]),
+                      MPI_BYTE,
+                      node,
+                      EXCHANGE_TAG,
+                      m_comm,
+                      &receives[node]);
+        }
+
+        for (int step = 0; step != m_size; ++step)
+        {
+            const int node = (m_rank + step) % m_size;
+
+            MPI_Isend(const_cast<char*>(send + send_offsets[node]),
+                      to_count(send_bytes[node]),
+                      MPI_BYTE,
+                      node,
+                      EXCHANGE_TAG,
+                      m_comm,
+                      &sends[node]);
+        }
+
+        for (int i = 0; i != m_size; ++i)
+        {
+            int node;
+            MPI_Waitany(m_size, receives.data(), &node, MPI_STATUS_IGNORE);
+            on_received(node);
+        }
+
+        MPI_Waitall(m_size, sends.data(), MPI_STATUSES_IGNORE);
+    }
+};
+#endif
+
+/*******************************************************************************
+* The amount of elements of a node and its least and greatest element.         *
+*******************************************************************************/
+template<class T>
+struct distributed_node_summary {
+    size_t length;
+    T first;
+    T last;
+};
+
+/*******************************************************************************
+* An element sampled at 'index' of the sorted data of the node of rank 'rank'. *
+* The samples, and the splitters chosen from them, are ordered by the element  *
+* and then by the rank and the index, so that every element of the nodes is    *
+* either before or after a splitter even when the elements are equal.          *
+*******************************************************************************/
+template<class T>
+struct distributed_sample {
+    T value;
+    size_t rank;
+    size_t index;
+};
+
+/*******************************************************************************
+* Merges the blocks of the exchange as they arrive. The blocks lie in          *
+* 'data' in rank order, the block of rank 'r' in the range                     *
+* [offsets[r], offsets[r + 1]). The blocks are the leaves of a balanced binary *
+* tree over the ranks, and the two halves of a subtree are merged as soon as   *
+* both are complete, so that the merges overlap with the blocks still in       *
+* transit. The merges are stable, and the lower rank comes first.              *
+*******************************************************************************/
+template<class T, class Cmp>
+class distributed_block_merger {
+private:
+
+    T* const m_data;
+    const std::vector<size_t>& m_offsets;
+    Cmp m_cmp;
+    std::vector<char> m_landed;
+    std::vector<char> m_merged;
+    std::vector<T> m_buffer;
+
+    /***************************************************************************
+    * Merges what may be merged in the subtree 'node' over the ranks           *
+    * [low, high). Returns true if the subtree is completely merged.           *
+    ***************************************************************************/
+    bool merge(const size_t node, const size_t low, const size_t high)
+    {
+        if (high - low == 1)
+        {
+            return m_landed[low] != 0;
+        }
+
+        if (m_merged[node])
+        {
+            return true;
+        }
+
+        const size_t middle = low + (high - low) / 2;
+        const bool left = merge(2 * node, low, middle);
+        const bool right = merge(2 * node + 1, middle, high);
+
+        if (!left || !right)
+        {
+            return false;
+        }
+
+        T* const first = m_data + m_offsets[low];
+        T* const mid = m_data + m_offsets[middle];
+        T* const last = m_data + m_offsets[high];
+
+        if (first != mid && mid != last)
+        {
+            size_t constructed = 0;
+            merge_adjacent_runs(first,
+                                mid,
+                                last,
+                                m_buffer.begin(),
+                                m_cmp,
+                                false,
+                                constructed);
+        }
+
+        m_merged[node] = 1;
+        return true;
+    }
+
+public:
+
+    distributed_block_merger(T* data,
+                             const std::vector<size_t>& offsets,
+                             Cmp cmp) :
+    m_data{data},
+    m_offsets(offsets),
+    m_cmp{cmp},
+    m_landed(offsets.size() - 1),
+    m_merged(4 * offsets.size()),
+    m_buffer(offsets.back() / 2 + 1)
+    {}
+
+    /***************************************************************************
+    * Records that the block of rank 'rank' has arrived, and merges the        *
+    * subtrees it completes.                                                   *
+    ***************************************************************************/
+    void land(const size_t rank)
+    {
+        m_landed[rank] = 1;
+        merge(1, 0, m_landed.size());
+    }
+};
+
+/*******************************************************************************
+* Returns true if the locally sorted data of the nodes, as summarized by       *
+* 'summaries', is sorted over the nodes in rank order and no node holds more   *
+* than 'imbalance' times the mean amount of elements.                          *
+*******************************************************************************/
+template<class T, class Cmp>
+bool is_range_partitioned(
+        const std::vector<distributed_node_summary<T>>& summaries,
+        const size_t total_length,
+        const double imbalance,
+        Cmp cmp)
+{
+    const distributed_node_summary<T>* p_previous = nullptr;
+
+    for (const distributed_node_summary<T>& summary : summaries)
+    {
+        if (summary.length > imbalance * total_length / summaries.size())
+        {
+            return false;
+        }
+
+        if (summary.length == 0)
+        {
+            continue;
+        }
+
+        if (p_previous && cmp(summary.first, p_previous->last))
+        {
+            return false;
+        }
+
+        p_previous = &summary;
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+* Chooses 'nodes - 1' splitters by regular sampling. Every node of rank 'r'    *
+* took its samples at 'samples_per_node' regular positions of its sorted data, *
+* or all of its elements if it has fewer, and the samples of rank 'r' start at *
+* 'samples[r * samples_per_node]'. Every sample stands for the elements up to  *
+* the next sample of its node, so the splitter 'k' is the first sample before  *
+* which about 'k / nodes' of all elements fall. A splitter past the last       *
+* sample is returned with the rank 'nodes', and no element is after it.        *
+*******************************************************************************/
+template<class T, class Cmp>
+std::vector<distributed_sample<T>>
+choose_splitters(const std::vector<distributed_sample<T>>& samples,
+                 const std::vector<distributed_node_summary<T>>& summaries,
+                 const size_t samples_per_node,
+                 const size_t total_length,
+                 Cmp cmp)
+{
+    const size_t nodes = summaries.size();
+    std::vector<distributed_sample<T>> sorted_samples;
+    std::vector<double> weights(nodes);
+
+    for (size_t rank = 0; rank != nodes; ++rank)
+    {
+        const size_t length = summaries[rank].length;
+        const size_t amount = std::min(samples_per_node, length);
+
+        if (amount != 0)
+        {
+            weights[rank] = (double) length / amount;
+        }
+
+        sorted_samples.insert(sorted_samples.end(),
+                              samples.begin() + rank * samples_per_node,
+                              samples.begin() + rank * samples_per_node
+                                  + amount);
+    }
+
+    auto sample_cmp = [&cmp](const distributed_sample<T>& a,
+                             const distributed_sample<T>& b)
+    {
+        if (cmp(a.value, b.value))
+        {
+            return true;
+        }
+
+        if (cmp(b.value, a.value))
+        {
+            return false;
+        }
+
+        return a.rank != b.rank ? a.rank < b.rank : a.index < b.index;
+    };
+
+    std::sort(sorted_samples.begin(), sorted_samples.end(), sample_cmp);
+
+    std::vector<distributed_sample<T>> splitters(nodes - 1);
+    size_t position = 0;
+    double preceding = 0.0;
+
+    for (size_t k = 1; k != nodes; ++k)
+    {
+        const double target = (double) total_length * k / nodes;
+
+        while (position != sorted_samples.size() && preceding < target)
+        {
+            preceding += weights[sorted_samples[position].rank];
+            ++position;
+        }
+
+        // The sample at 'position' is the first with at least 'target'
+        // elements before it.
+        if (position == sorted_samples.size())
+        {
+            splitters[k - 1].rank = nodes;
+        }
+        else
+        {
+            splitters[k - 1] = sorted_samples[position];
+        }
+    }
+
+    return splitters;
+}
+
+/*******************************************************************************
+* Returns the amount of the elements of the sorted 'data' of the node of rank  *
+* 'rank' that are before 'splitter' in the order of the samples.               *
+*******************************************************************************/
+template<class T, class Cmp>
+size_t split_position(const std::vector<T>& data,
+                      const size_t rank,
+                      const distributed_sample<T>& splitter,
+                      const size_t nodes,
+                      Cmp cmp)
+{
+    if (splitter.rank == nodes)
+    {
+        return data.size();
+    }
+
+    if (splitter.rank == rank)
+    {
+        return splitter.index;
+    }
+
+    if (rank < splitter.rank)
+    {
+        // The elements equal to the splitter are before it.
+        return std::upper_bound(data.begin(), data.end(), splitter.value, cmp)
+               - data.begin();
+    }
+
+    return std::lower_bound(data.begin(), data.end(), splitter.value, cmp)
+           - data.begin();
+}
+
+/*******************************************************************************
+* Sorts the elements of 'data' of all the nodes connected by 'transport', as   *
+* specified by 'options'. Every node calls this collectively. Afterwards the   *
+* 'data' of every node is sorted, and no element of a node is before an        *
+* element of a node of lower rank.                                             *
+*                                                                              *
+* Every node first sorts its data with 'parallel_natural_merge_sort'. If the   *
+* sorted data is already partitioned by range over the nodes and balanced, the *
+* sort stops there. Otherwise every node samples its sorted data at regular    *
+* positions, and the gathered samples give the splitters between the nodes.    *
+* Every node cuts its data at the splitters, sends every range to its node,    *
+* and merges the received sorted blocks while the others still arrive. The     *
+* sort is stable with respect to the rank of the node and the position within  *
+* its data. The elements must be trivially copyable.                           *
+*******************************************************************************/
+template<class T, class Cmp>
+void distributed_natural_merge_sort(std::vector<T>& data,
+                                    Cmp cmp,
+                                    DistributedTransport& transport,
+                                    const DistributedSortOptions& options)
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "The elements must be trivially copyable.");
+
+    const size_t nodes = transport.size();
+    const size_t rank = transport.rank();
+
+    parallel_natural_merge_sort(data.begin(),
+                                data.end(),
+                                cmp,
+                                options.sort_options);
+
+    if (nodes < 2)
+    {
+        return;
+    }
+
+    distributed_node_summary<T> summary = distributed_node_summary<T>();
+    summary.length = data.size();
+
+    if (!data.empty())
+    {
+        summary.first = data.front();
+        summary.last = data.back();
+    }
+
+    std::vector<distributed_node_summary<T>> summaries(nodes);
+    transport.allGather(&summary, sizeof(summary), summaries.data());
+
+    size_t total_length = 0;
+
+    for (const distributed_node_summary<T>& node_summary : summaries)
+    {
+        total_length += node_summary.length;
+    }
+
+    if (options.presorted_fast_path &&
+        is_range_partitioned(summaries,
+                             total_length,
+                             options.presorted_imbalance,
+                             cmp))
+    {
+        return;
+    }
+
+    // Sample the sorted data at regular positions.
+    const size_t samples_per_node =
+            std::max((size_t) 1, options.oversampling) * nodes;
+    std::vector<distributed_sample<T>> samples(samples_per_node);
+    const size_t sample_amount = std::min(samples_per_node, data.size());
+
+    for (size_t i = 0; i != sample_amount; ++i)
+    {
+        const size_t index = i * data.size() / sample_amount;
+        samples[i].value = data[index];
+        samples[i].rank = rank;
+        samples[i].index = index;
+    }
+
+    std::vector<distributed_sample<T>> all_samples(samples_per_node * nodes);
+    transport.allGather(samples.data(),
+                        samples_per_node * sizeof(distributed_sample<T>),
+                        all_samples.data());
+
+    const std::vector<distributed_sample<T>> splitters =
+            choose_splitters(all_samples,
+                             summaries,
+                             samples_per_node,
+                             total_length,
+                             cmp);
+
+    // Cut the data at the splitters, and tell every node how much it gets.
+    std::vector<size_t> send_counts(nodes);
+    size_t cut = 0;
+
+    for (size_t node = 0; node != nodes; ++node)
+    {
+        size_t next_cut = data.size();
+
+        if (node + 1 != nodes)
+        {
+            next_cut = std::max(cut, split_position(data,
+                                                    rank,
+                                                    splitters[node],
+                                                    nodes,
+                                                    cmp));
+        }
+
+        send_counts[node] = next_cut - cut;
+        cut = next_cut;
+    }
+
+    std::vector<size_t> count_matrix(nodes * nodes);
+    transport.allGather(send_counts.data(),
+                        nodes * sizeof(size_t),
+                        count_matrix.data());
+
+    std::vector<size_t> send_offsets(nodes);
+    std::vector<size_t> send_bytes(nodes);
+    std::vector<size_t> receive_offsets(nodes + 1);
+    std::vector<size_t> receive_bytes(nodes);
+    size_t send_offset = 0;
+
+    for (size_t node = 0; node != nodes; ++node)
+    {
+        send_offsets[node] = send_offset * sizeof(T);
+        send_bytes[node] = send_counts[node] * sizeof(T);
+        send_offset += send_counts[node];
+
+        const size_t receive_count = count_matrix[node * nodes + rank];
+        receive_offsets[node + 1] = receive_offsets[node] + receive_count;
+        receive_bytes[node] = receive_count * sizeof(T);
+    }
+
+    std::vector<T> received(receive_offsets[nodes]);
+    distributed_block_merger<T, Cmp> merger(received.data(),
+                                            receive_offsets,
+                                            cmp);
+
+    // The offsets are in elements for the merger and in bytes for the
+    // transport.
+    std::vector<size_t> receive_byte_offsets(nodes);
+
+    for (size_t node = 0; node != nodes; ++node)
+    {
+        receive_byte_offsets[node] = receive_offsets[node] * sizeof(T);
+    }
+
+    transport.allToAll(reinterpret_cast<const char*>(data.data()),
+                       send_offsets.data(),
+                       send_bytes.data(),
+                       reinterpret_cast<char*>(received.data()),
+                       receive_byte_offsets.data(),
+                       receive_bytes.data(),
+                       [&merger](const size_t source)
+                       {
+                           merger.land(source);
+                       });
+
+    data.swap(received);
+}
+
+/*******************************************************************************
+* Sorts the elements of 'data' of all the nodes connected by 'transport' with  *
+* the default options.                                                         *
+*******************************************************************************/
+template<class T, class Cmp>
+void distributed_natural_merge_sort(std::vector<T>& data,
+                                    Cmp cmp,
+                                    DistributedTransport& transport)
+{
+    distributed_natural_merge_sort(data,
+                                   cmp,
+                                   transport,
+                                   DistributedSortOptions());
+}
+#endif
@@ -0,0 +1,469 @@
+#ifndef EXTERNAL_NATURAL_MERGE_SORT_H
+#define EXTERNAL_NATURAL_MERGE_SORT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include "parallel_natural_merge_sort.h"
+
+/*******************************************************************************
+* Collects the options of the external natural merge sort.                     *
+*******************************************************************************/
+struct ExternalSortOptions {
+
+    // The most bytes of memory the sort may hold in records. A chunk of the
+    // input and the scratch buffer sorting it take half of this each, and
+    // the merges split it among the blocks of their files.
+    size_t memory_budget;
+
+    // The amount of bytes read or written at a time from every file during
+    // the merges. Larger blocks mean fewer seeks between the files.
+    size_t io_block_size;
+
+    // The most run files merged at a time. Further merge passes are done if
+    // there are more runs than this.
+    size_t merge_fan_in;
+
+    // The options for sorting the chunks in memory with
+    // 'parallel_natural_merge_sort'.
+    NaturalMergeSortOptions sort_options;
+
+    ExternalSortOptions() :
+    memory_budget{(size_t) 1 << 30},
+    io_block_size{(size_t) 1 << 22},
+    merge_fan_in{64}
+    {}
+};
+
+/*******************************************************************************
+* Owns a file opened with 'std::fopen' and reads or writes records of type 'T' *
+* in blocks. Every failure is reported by throwing 'std::system_error'.        *
+*******************************************************************************/
+template<class T>
+class external_record_file {
+private:
+
+    std::FILE* m_file;
+    std::string m_path;
+
+    void fail(const char* what) const
+    {
+        throw std::system_error(errno,
+                                std::generic_category(),
+                                std::string(what) + " '" + m_path + "'");
+    }
+
+public:
+
+    external_record_file(const std::string& path, const char* mode) :
+    m_file{std::fopen(path.c_str(), mode)},
+    m_path(path)
+    {
+        if (!m_file)
+        {
+            fail("Cannot open");
+        }
+
+        // The blocks are large, so the stream need not buffer them again.
+        std::setvbuf(m_file, nullptr, _IONBF, 0);
+    }
+
+    external_record_file(const external_record_file&) = delete;
+    external_record_file& operator=(const external_record_file&) = delete;
+
+    ~external_record_file()
+    {
+        if (m_file)
+        {
+            std::fclose(m_file);
+        }
+    }
+
+    /***************************************************************************
+    * Reads at most 'count' records into 'records' and returns the amount of   *
+    * the records read, which is less than 'count' only at the end of file.    *
+    ***************************************************************************/
+    size_t read(T* records, const size_t count)
+    {
+        if (count == 0)
+        {
+            return 0;
+        }
+
+        const size_t read_count = std::fread(records, sizeof(T), count, m_file);
+
+        if (read_count < count && std::ferror(m_file))
+        {
+            fail("Cannot read");
+        }
+
+        return read_count;
+    }
+
+    /***************************************************************************
+    * Writes the 'count' records starting at 'records'.                        *
+    ***************************************************************************/
+    void write(const T* records, const size_t count)
+    {
+        if (count != 0 && std::fwrite(records, sizeof(T), count, m_file) != count)
+        {
+            fail("Cannot write");
+        }
+    }
+
+    /***************************************************************************
+    * Closes the file, reporting the errors of the last writes.                *
+    ***************************************************************************/
+    void close()
+    {
+        std::FILE* file = m_file;
+        m_file = nullptr;
+
+        if (std::fclose(file) != 0)
+        {
+            fail("Cannot close");
+        }
+    }
+
+    /***************************************************************************
+    * Returns the amount of records in the file, which must be a whole amount. *
+    ***************************************************************************/
+    size_t record_count()
+    {
+        if (std::fseek(m_file, 0, SEEK_END) != 0)
+        {
+            fail("Cannot seek");
+        }
+
+        const long bytes = std::ftell(m_file);
+
+        if (bytes < 0 || std::fseek(m_file, 0, SEEK_SET) != 0)
+        {
+            fail("Cannot seek");
+        }
+
+        if (bytes % sizeof(T) != 0)
+        {
+            errno = EINVAL;
+            fail("Not a whole amount of records in");
+        }
+
+        return bytes / sizeof(T);
+    }
+};
+
+/*******************************************************************************
+* Removes the temporary run files whose paths it holds when it is destroyed,   *
+* so that no runs are left behind if the sort fails.                           *
+*******************************************************************************/
+struct external_run_files {
+    std::vector<std::string> paths;
+
+    ~external_run_files()
+    {
+        for (const std::string& path : paths)
+        {
+            std::remove(path.c_str());
+        }
+    }
+};
+
+/*******************************************************************************
+* Reads the records of a sorted run file one block at a time.                  *
+*******************************************************************************/
+template<class T>
+class external_run_reader {
+private:
+
+    external_record_file<T> m_file;
+    std::vector<T> m_block;
+    size_t m_position;
+    size_t m_size;
+
+public:
+
+    external_run_reader(const std::string& path, const size_t block_records) :
+    m_file(path, "rb"),
+    m_block(block_records),
+    m_position{0},
+    m_size{0}
+    {
+        refill();
+    }
+
+    /***************************************************************************
+    * Reads the next block. Returns false if the run is exhausted.             *
+    ***************************************************************************/
+    bool refill()
+    {
+        m_size = m_file.read(m_block.data(), m_block.size());
+        m_position = 0;
+        return m_size > 0;
+    }
+
+    bool empty() const
+    {
+        return m_position == m_size;
+    }
+
+    const T& front() const
+    {
+        return m_block[m_position];
+    }
+
+    /***************************************************************************
+    * Drops the front record. Returns false if the run is exhausted.           *
+    ***************************************************************************/
+    bool pop()
+    {
+        return ++m_position != m_size || refill();
+    }
+};
+
+/*******************************************************************************
+* Merges the sorted run files 'paths[first]', ..., 'paths[last - 1]' into the  *
+* file 'output_path' using blocks of 'block_records' records. The runs appear  *
+* in the order of the input, and ties are broken in favour of the earlier run, *
+* so the merge is stable.                                                      *
+*******************************************************************************/
+template<class T, class Cmp>
+void external_merge_runs(const std::vector<std::string>& paths,
+                         const size_t first,
+                         const size_t last,
+                         const std::string& output_path,
+                         const size_t block_records,
+                         Cmp cmp)
+{
+    std::vector<std::unique_ptr<external_run_reader<T>>> readers;
+    std::vector<size_t> heap;
+
+    for (size_t i = first; i != last; ++i)
+    {
+        readers.emplace_back(new external_run_reader<T>(paths[i],
+                                                        block_records));
+
+        if (!readers.back()->empty())
+        {
+            heap.push_back(readers.size() - 1);
+        }
+    }
+
+    // 'std::make_heap' keeps the greatest element on top, so the heap order
+    // is the reverse of the output order.
+    auto heap_cmp = [&readers, &cmp](const size_t a, const size_t b)
+    {
+        const T& record_a = readers[a]->front();
+        const T& record_b = readers[b]->front();
+
+        if (cmp(record_b, record_a))
+        {
+            return true;
+        }
+
+        return !cmp(record_a, record_b) && a > b;
+    };
+
+    std::make_heap(heap.begin(), heap.end(), heap_cmp);
+
+    external_record_file<T> output(output_path, "wb");
+    std::vector<T> block;
+    block.reserve(block_records);
+
+    while (!heap.empty())
+    {
+        std::pop_heap(heap.begin(), heap.end(), heap_cmp);
+        external_run_reader<T>& reader = *readers[heap.back()];
+        block.push_back(reader.front());
+
+        if (block.size() == block_records)
+        {
+            output.write(block.data(), block.size());
+            block.clear();
+        }
+
+        if (reader.pop())
+        {
+            std::push_heap(heap.begin(), heap.end(), heap_cmp);
+        }
+        else
+        {
+            heap.pop_back();
+        }
+    }
+
+    output.write(block.data(), block.size());
+    output.close();
+}
+
+/*******************************************************************************
+* Sorts the file 'input_path' of fixed-width records of type 'T' into the file *
+* 'output_path', which may be the same file, as specified by 'options'.        *
+*                                                                              *
+* The input is read in chunks that fit in half of the memory budget, each of   *
+* which is sorted by 'parallel_natural_merge_sort'. A sorted chunk that does   *
+* not start below the end of the previous one continues the run of that        *
+* chunk, and is appended to its run file; otherwise it starts a new run file   *
+* next to the output. The run files are then merged 'merge_fan_in' at a time   *
+* with block-sized sequential reads and writes until a single run remains,     *
+* which is renamed to the output. A presorted file thus takes a single pass    *
+* of reading and writing, and a file of K runs about log(K) / log(fan-in)      *
+* more passes. The sort is stable. The records must be trivially copyable and  *
+* default constructible. Throws 'std::system_error' on I/O errors.             *
+*******************************************************************************/
+template<class T, class Cmp>
+void external_natural_merge_sort(const std::string& input_path,
+                                 const std::string& output_path,
+                                 Cmp cmp,
+                                 const ExternalSortOptions& options)
+{
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "The records must be trivially copyable.");
+    static_assert(std::is_default_constructible<T>::value,
+                  "The records must be default constructible.");
+
+    const size_t chunk_records =
+            std::max((size_t) 1, options.memory_budget / (2 * sizeof(T)));
+    size_t block_records =
+            std::max((size_t) 1, options.io_block_size / sizeof(T));
+
+    if (options.memory_budget /
+            std::max((size_t) 1, options.io_block_size) < 3)
+    {
+        // Shrink the blocks so that two inputs and the output fit.
+        block_records =
+                std::max((size_t) 1, options.memory_budget / (3 * sizeof(T)));
+    }
+
+    const size_t budget_blocks =
+            options.memory_budget / (block_records * sizeof(T));
+    const size_t fan_in =
+            std::max((size_t) 2,
+                     std::min(options.merge_fan_in,
+                              budget_blocks > 1 ? budget_blocks - 1 : 0));
+
+    external_run_files runs;
+
+    // Form the runs, extending a run for as long as the chunks continue it.
+    {
+        external_record_file<T> input(input_path, "rb");
+        std::vector<T> chunk(std::min(chunk_records, input.record_count()));
+        ScratchBuffer<T> scratch;
+        std::unique_ptr<external_record_file<T>> run;
+        T run_last = T();
+
+        while (true)
+        {
+            const size_t count = input.read(chunk.data(), chunk.size());
+
+            if (count == 0)
+            {
+                break;
+            }
+
+            parallel_natural_merge_sort(chunk.begin(),
+                                        chunk.begin() + count,
+                                        cmp,
+                                        scratch,
+                                        options.sort_options);
+
+            if (!run || cmp(chunk[0], run_last))
+            {
+                if (run)
+                {
+                    run->close();
+                }
+
+                runs.paths.push_back(output_path + ".run0." +
+                                     std::to_string(runs.paths.size()));
+                run.reset(new external_record_file<T>(runs.paths.back(),
+                                                      "wb"));
+            }
+
+            run->write(chunk.data(), count);
+            run_last = chunk[count - 1];
+        }
+
+        if (run)
+        {
+            run->close();
+        }
+    }
+
+    if (runs.paths.empty())
+    {
+        // The input is empty.
+        external_record_file<T>(output_path, "wb").close();
+        return;
+    }
+
+    // Merge the runs 'fan_in' at a time.
+    for (size_t pass = 1; runs.paths.size() > 1; ++pass)
+    {
+        external_run_files merged;
+
+        for (size_t first = 0; first < runs.paths.size(); first += fan_in)
+        {
+            const size_t last = std::min(first + fan_in, runs.paths.size());
+
+            merged.paths.push_back(output_path + ".run" +
+                                   std::to_string(pass) + "." +
+                                   std::to_string(merged.paths.size()));
+
+            if (last - first == 1)
+            {
+                if (std::rename(runs.paths[first].c_str(),
+                                merged.paths.back().c_str()) != 0)
+                {
+                    throw std::system_error(errno,
+                                            std::generic_category(),
+                                            "Cannot rename '" +
+                                            runs.paths[first] + "'");
+                }
+            }
+            else
+            {
+                external_merge_runs<T>(runs.paths,
+                                       first,
+                                       last,
+                                       merged.paths.back(),
+                                       block_records,
+                                       cmp);
+            }
+        }
+
+        // Remove the merged runs, and keep the new ones.
+        std::swap(runs.paths, merged.paths);
+    }
+
+    if (std::rename(runs.paths[0].c_str(), output_path.c_str()) != 0)
+    {
+        throw std::system_error(errno,
+                                std::generic_category(),
+                                "Cannot rename '" + runs.paths[0] +
+                                "' to '" + output_path + "'");
+    }
+
+    runs.paths.clear();
+}
+
+/*******************************************************************************
+* Sorts the file 'input_path' of fixed-width records of type 'T' into the file *
+* 'output_path' with the default options.                                      *
+*******************************************************************************/
+template<class T, class Cmp>
+void external_natural_merge_sort(const std::string& input_path,
+                                 const std::string& output_path,
+                                 Cmp cmp)
+{
+    external_natural_merge_sort<T>(input_path,
+                                   output_path,
+                                   cmp,
+                                   ExternalSortOptions());
+}
+#endif
@@ -1,283 +1,1192 @@
+#include <algorithm>
 #include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <iostream>
+#include <limits>
 #include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
+// Define 'BENCHMARK_PARALLEL_STL' to compare against the parallel standard
+// algorithms as well. They need C++17, and with libstdc++ usually -ltbb.
+#ifdef BENCHMARK_PARALLEL_STL
+#include <execution>
+#endif
+
+#include "distributed_natural_merge_sort.h"
+#include "external_natural_merge_sort.h"
 #include "parallel_natural_merge_sort.h"
 
+// The amount of distinct keys of the few-distinct input.
+static constexpr std::int64_t FEW_DISTINCT_KEYS = 16;
+
+// The amount of ascending teeth of the sawtooth input.
+static constexpr size_t SAWTOOTH_TEETH = 16;
+
+// No element of the k-sorted input lies farther than this from its place.
+static constexpr std::int64_t K_SORTED_DISTANCE = 64;
+
+// The append-tail input has one unsorted element per this many elements.
+static constexpr size_t APPEND_TAIL_DIVISOR = 100;
+
+// The external sort sorts its input file in about this many chunks, and
+// merges this many runs at a time, so that it takes several merge passes.
+static constexpr size_t EXTERNAL_SORT_CHUNKS = 16;
+static constexpr size_t EXTERNAL_SORT_FAN_IN = 4;
+
+// The file the external sort sorts, in the working directory.
+static const char* const EXTERNAL_SORT_PATH =
+        "natural_merge_sort_benchmark.bin";
+
+// The distributed sort splits its input among this many nodes, which run as
+// threads of the benchmark.
+static constexpr size_t DISTRIBUTED_SORT_NODES = 4;
+
+// The input, the reference, the working copy and the scratch buffer.
+static constexpr size_t COPIES_PER_CELL = 4;
+
+static const char* const TYPE_NAMES[] = {
+    "int",
+    "int64",
+    "double",
+    "pointer",
+    "record64",
+    "string"
+};
+
+static constexpr size_t TYPE_AMOUNT = 6;
+
 /*******************************************************************************
-* Creates a random integer array of length 'length', minimum integer           *
-* 'minimum', maximum integer 'maximum', using seed 'seed'.                     *
+* Lists the shapes of the benchmarked inputs.                                  *
 *******************************************************************************/
-static int* get_random_int_array(const size_t length,
-                                 const int minimum,
-                                 const int maximum,
-                                 const unsigned int seed)
+enum class InputShape {
+    RANDOM,
+    FEW_DISTINCT,
+    SORTED,
+    REVERSED,
+    SAWTOOTH,
+    ORGAN_PIPE,
+    K_SORTED,
+    APPEND_TAIL
+};
+
+static const char* const INPUT_SHAPE_NAMES[] = {
+    "random",
+    "few_distinct",
+    "sorted",
+    "reversed",
+    "sawtooth",
+    "organ_pipe",
+    "k_sorted",
+    "append_tail"
+};
+
+static constexpr size_t INPUT_SHAPE_AMOUNT = 8;
+
+/*******************************************************************************
+* Lists the benchmarked sorting algorithms. 'NATURAL_MERGE_SORT_APPEND' sorts  *
+* only the unsorted tail of the append-tail input onto its sorted prefix.      *
+* 'NATURAL_MERGE_SORT_UNSTABLE' is the natural merge sort with the stability   *
+* turned off in its options, and 'NATURAL_MERGE_SORT_INDIRECT' sorts the       *
+* indices of the elements and permutes the elements once at the end.           *
+* 'EXTERNAL_NATURAL_MERGE_SORT' writes the elements to a file, sorts the file  *
+* under a small memory budget and reads it back, and                           *
+* 'DISTRIBUTED_NATURAL_MERGE_SORT' sorts the slices of the elements on nodes   *
+* connected by a 'ThreadTransport'. Both work only for the trivially copyable  *
+* types.                                                                       *
+*******************************************************************************/
+enum class Algorithm {
+    STD_SORT,
+    STD_STABLE_SORT,
+    STD_PARALLEL_STABLE_SORT,
+    NATURAL_MERGE_SORT,
+    PARALLEL_NATURAL_MERGE_SORT,
+    NATURAL_MERGE_SORT_APPEND,
+    NATURAL_MERGE_SORT_UNSTABLE,
+    NATURAL_MERGE_SORT_INDIRECT,
+    EXTERNAL_NATURAL_MERGE_SORT,
+    DISTRIBUTED_NATURAL_MERGE_SORT
+};
+
+static const char* const ALGORITHM_NAMES[] = {
+    "std::sort",
+    "std::stable_sort",
+    "std::stable_sort(par)",
+    "natural_merge_sort",
+    "parallel_natural_merge_sort",
+    "natural_merge_sort_append",
+    "natural_merge_sort(unstable)",
+    "natural_merge_sort(indirect)",
+    "external_natural_merge_sort",
+    "distributed_natural_merge_sort"
+};
+
+static constexpr size_t ALGORITHM_AMOUNT = 10;
+
+/*******************************************************************************
+* A 64-byte record sorted by its key. The payload starts with the position of  *
+* the record in the input, so that comparing the records whole also checks     *
+* the stability of a sort.                                                     *
+*******************************************************************************/
+struct Record64 {
+    std::int64_t key;
+    char payload[56];
+};
+
+static_assert(sizeof(Record64) == 64, "A record must take 64 bytes.");
+
+static bool operator==(const Record64& a, const Record64& b)
 {
-    std::default_random_engine generator(seed);
-    std::uniform_int_distribution<int> distribution(minimum, maximum);
+    return a.key == b.key &&
+           std::memcmp(a.payload, b.payload, sizeof(a.payload)) == 0;
+}
+
+/*******************************************************************************
+* Each of the following describes an element type: its name, the approximate   *
+* amount of memory an element takes, how the elements are made of the keys of  *
+* an input, and how they are compared.                                         *
+*******************************************************************************/
+struct IntElements {
+    typedef int value_type;
+    typedef std::less<int> compare;
+
+    static const char* name() { return "int"; }
+    static size_t bytes() { return sizeof(int); }
+
+    std::vector<int> make(const std::vector<std::int64_t>& keys)
+    {
+        return std::vector<int>(keys.begin(), keys.end());
+    }
+};
+
+struct Int64Elements {
+    typedef std::int64_t value_type;
+    typedef std::less<std::int64_t> compare;
+
+    static const char* name() { return "int64"; }
+    static size_t bytes() { return sizeof(std::int64_t); }
+
+    std::vector<std::int64_t> make(const std::vector<std::int64_t>& keys)
+    {
+        return keys;
+    }
+};
+
+struct DoubleElements {
+    typedef double value_type;
+    typedef std::less<double> compare;
+
+    static const char* name() { return "double"; }
+    static size_t bytes() { return sizeof(double); }
+
+    std::vector<double> make(const std::vector<std::int64_t>& keys)
+    {
+        return std::vector<double>(keys.begin(), keys.end());
+    }
+};
+
+/*******************************************************************************
+* Pointers to the keys, which are stored in the order of the input, so that    *
+* the sorts chase the pointers all over the memory as the input gets sorted.   *
+*******************************************************************************/
+struct PointerElements {
+    typedef const std::int64_t* value_type;
+
+    struct compare {
+        bool operator()(const std::int64_t* a, const std::int64_t* b) const
+        {
+            return *a < *b;
+        }
+    };
+
+    std::vector<std::int64_t> m_values;
+
+    static const char* name() { return "pointer"; }
+
+    static size_t bytes()
+    {
+        return sizeof(value_type) + sizeof(std::int64_t);
+    }
+
+    std::vector<value_type> make(const std::vector<std::int64_t>& keys)
+    {
+        m_values = keys;
+        std::vector<value_type> pointers(keys.size());
+
+        for (size_t i = 0; i != keys.size(); ++i)
+        {
+            pointers[i] = &m_values[i];
+        }
+
+        return pointers;
+    }
+};
+
+struct Record64Elements {
+    typedef Record64 value_type;
+
+    struct compare {
+        bool operator()(const Record64& a, const Record64& b) const
+        {
+            return a.key < b.key;
+        }
+    };
+
+    static const char* name() { return "record64"; }
+    static size_t bytes() { return sizeof(Record64); }
 
-    int* array = new int[length];
+    std::vector<Record64> make(const std::vector<std::int64_t>& keys)
+    {
+        std::vector<Record64> records(keys.size());
+
+        for (size_t i = 0; i != keys.size(); ++i)
+        {
+            const std::uint64_t position = i;
+            records[i].key = keys[i];
+            std::memset(records[i].payload, 0, sizeof(records[i].payload));
+            std::memcpy(records[i].payload, &position, sizeof(position));
+        }
+
+        return records;
+    }
+};
+
+/*******************************************************************************
+* Strings of 17 characters, too long to be stored within the string objects,   *
+* made of a common prefix and the zero-padded key, so that they compare in the *
+* order of the keys.                                                           *
+*******************************************************************************/
+struct StringElements {
+    typedef std::string value_type;
+    typedef std::less<std::string> compare;
+
+    static const char* name() { return "string"; }
 
-    for (size_t i = 0; i < length; ++i)
+    static size_t bytes()
     {
-        array[i] = distribution(generator);
+        return sizeof(std::string) + 32;
     }
 
-    return array;
+    std::vector<std::string> make(const std::vector<std::int64_t>& keys)
+    {
+        std::vector<std::string> strings(keys.size());
+        char text[32];
+
+        for (size_t i = 0; i != keys.size(); ++i)
+        {
+            std::snprintf(text, sizeof(text), "item-%012lld",
+                          (long long) keys[i]);
+            strings[i] = text;
+        }
+
+        return strings;
+    }
+};
+
+/*******************************************************************************
+* Returns the length of the sorted prefix of an input of the shape 'shape'.    *
+*******************************************************************************/
+static size_t get_sorted_prefix(const InputShape shape, const size_t length)
+{
+    return shape == InputShape::APPEND_TAIL ?
+           length - length / APPEND_TAIL_DIVISOR : 0;
 }
 
 /*******************************************************************************
-* Create an array of pointers to integers.                                     *
+* Creates the keys of an input of shape 'shape' and length 'length' using the  *
+* seed 'seed'. All the keys fit in an 'int'.                                   *
 *******************************************************************************/
-static int** get_random_int_pointer_array(const size_t length,
-                                          const int minimum,
-                                          const int maximum,
-                                          const unsigned seed)
+static std::vector<std::int64_t> get_input_keys(const InputShape shape,
+                                                const size_t length,
+                                                const unsigned seed)
 {
-    std::default_random_engine generator(seed);
-    std::uniform_int_distribution<int> distribution(minimum, maximum);
+    std::mt19937_64 generator(seed);
+    std::vector<std::int64_t> keys(length);
+    const std::int64_t n = (std::int64_t) length;
+
+    switch (shape)
+    {
+        case InputShape::RANDOM:
+        {
+            std::uniform_int_distribution<std::int64_t>
+                    distribution(0, std::numeric_limits<int>::max());
+
+            for (std::int64_t& key : keys)
+            {
+                key = distribution(generator);
+            }
+
+            break;
+        }
+
+        case InputShape::FEW_DISTINCT:
+        {
+            std::uniform_int_distribution<std::int64_t>
+                    distribution(0, FEW_DISTINCT_KEYS - 1);
+
+            for (std::int64_t& key : keys)
+            {
+                key = distribution(generator);
+            }
+
+            break;
+        }
+
+        case InputShape::SORTED:
+
+            for (std::int64_t i = 0; i != n; ++i)
+            {
+                keys[i] = i;
+            }
+
+            break;
+
+        case InputShape::REVERSED:
+
+            for (std::int64_t i = 0; i != n; ++i)
+            {
+                keys[i] = n - i;
+            }
+
+            break;
 
-    int** array = new int*[length];
+        case InputShape::SAWTOOTH:
+        {
+            const std::int64_t tooth =
+                    std::max((std::int64_t) 1,
+                             n / (std::int64_t) SAWTOOTH_TEETH);
 
-    for (size_t i = 0; i < length; ++i)
+            for (std::int64_t i = 0; i != n; ++i)
+            {
+                keys[i] = i % tooth;
+            }
+
+            break;
+        }
+
+        case InputShape::ORGAN_PIPE:
+
+            for (std::int64_t i = 0; i != n; ++i)
+            {
+                keys[i] = i < n / 2 ? i : n - i;
+            }
+
+            break;
+
+        case InputShape::K_SORTED:
+        {
+            std::uniform_int_distribution<std::int64_t>
+                    distribution(0, K_SORTED_DISTANCE - 1);
+
+            for (std::int64_t i = 0; i != n; ++i)
+            {
+                keys[i] = i + distribution(generator);
+            }
+
+            break;
+        }
+
+        case InputShape::APPEND_TAIL:
+        {
+            const std::int64_t prefix =
+                    (std::int64_t) get_sorted_prefix(shape, length);
+            std::uniform_int_distribution<std::int64_t>
+                    distribution(0, 2 * n);
+
+            for (std::int64_t i = 0; i != prefix; ++i)
+            {
+                keys[i] = 2 * i;
+            }
+
+            for (std::int64_t i = prefix; i != n; ++i)
+            {
+                keys[i] = distribution(generator);
+            }
+
+            break;
+        }
+    }
+
+    return keys;
+}
+
+/*******************************************************************************
+* Collects the settings of a benchmark run.                                    *
+*******************************************************************************/
+struct BenchmarkSettings {
+    std::vector<std::string> types;
+    bool shapes[INPUT_SHAPE_AMOUNT];
+    bool algorithms[ALGORITHM_AMOUNT];
+    size_t min_size;
+    size_t max_size;
+    size_t size_factor;
+    size_t warmup;
+    size_t trials;
+    size_t max_bytes;
+    unsigned seed;
+    bool json;
+    NaturalMergeSortOptions sort_options;
+
+    BenchmarkSettings() :
+    types(TYPE_NAMES, TYPE_NAMES + TYPE_AMOUNT),
+    min_size{1000},
+    max_size{1000000},
+    size_factor{10},
+    warmup{1},
+    trials{5},
+    max_bytes{(size_t) 1 << 32},
+    seed{1},
+    json{false}
     {
-        array[i] = new int(distribution(generator));
+        std::fill(shapes, shapes + INPUT_SHAPE_AMOUNT, true);
+        std::fill(algorithms, algorithms + ALGORITHM_AMOUNT, true);
+
+#ifndef BENCHMARK_PARALLEL_STL
+        algorithms[(size_t) Algorithm::STD_PARALLEL_STABLE_SORT] = false;
+#endif
     }
+};
+
+/*******************************************************************************
+* Holds the timings of one algorithm on one input, in nanoseconds.             *
+*******************************************************************************/
+struct BenchmarkResult {
+    const char* type;
+    InputShape shape;
+    size_t length;
+    Algorithm algorithm;
+    size_t trials;
+    long long median;
+    long long minimum;
+    long long maximum;
+    bool correct;
+};
 
-    return array;
+/*******************************************************************************
+* Writes the results as CSV or as a JSON array, one result at a time so that   *
+* a long sweep reports as it goes.                                             *
+*******************************************************************************/
+class ResultWriter {
+private:
+
+    bool m_json;
+    size_t m_count;
+    size_t m_failures;
+
+public:
+
+    explicit ResultWriter(const bool json) :
+    m_json{json},
+    m_count{0},
+    m_failures{0}
+    {
+        if (m_json)
+        {
+            std::cout << "[" << std::endl;
+        }
+        else
+        {
+            std::cout << "type,input,size,algorithm,trials,median_ns,"
+                      << "min_ns,max_ns,ns_per_element,correct"
+                      << std::endl;
+        }
+    }
+
+    ~ResultWriter()
+    {
+        if (m_json)
+        {
+            std::cout << (m_count == 0 ? "" : "\n") << "]" << std::endl;
+        }
+    }
+
+    void write(const BenchmarkResult& result)
+    {
+        const double per_element =
+                (double) result.median / std::max(result.length, (size_t) 1);
+        char per_element_text[32];
+        std::snprintf(per_element_text,
+                      sizeof(per_element_text),
+                      "%.3f",
+                      per_element);
+
+        if (m_json)
+        {
+            std::cout << (m_count == 0 ? "" : ",\n")
+                      << "  {\"type\": \"" << result.type
+                      << "\", \"input\": \""
+                      << INPUT_SHAPE_NAMES[(size_t) result.shape]
+                      << "\", \"size\": " << result.length
+                      << ", \"algorithm\": \""
+                      << ALGORITHM_NAMES[(size_t) result.algorithm]
+                      << "\", \"trials\": " << result.trials
+                      << ", \"median_ns\": " << result.median
+                      << ", \"min_ns\": " << result.minimum
+                      << ", \"max_ns\": " << result.maximum
+                      << ", \"ns_per_element\": " << per_element_text
+                      << ", \"correct\": "
+                      << (result.correct ? "true" : "false") << "}";
+        }
+        else
+        {
+            std::cout << result.type << ","
+                      << INPUT_SHAPE_NAMES[(size_t) result.shape] << ","
+                      << result.length << ","
+                      << ALGORITHM_NAMES[(size_t) result.algorithm] << ","
+                      << result.trials << ","
+                      << result.median << ","
+                      << result.minimum << ","
+                      << result.maximum << ","
+                      << per_element_text << ","
+                      << (result.correct ? "true" : "false")
+                      << std::endl;
+        }
+
+        ++m_count;
+        m_failures += result.correct ? 0 : 1;
+        std::cout.flush();
+    }
+
+    /***************************************************************************
+    * Returns the amount of results written whose sorts went wrong.            *
+    ***************************************************************************/
+    size_t failures() const
+    {
+        return m_failures;
+    }
+};
+
+/*******************************************************************************
+* Sorts 'array' with 'external_natural_merge_sort' through the file            *
+* 'EXTERNAL_SORT_PATH', which is removed afterwards.                           *
+*******************************************************************************/
+template<class T, class Cmp>
+static void run_external_sort(std::vector<T>& array,
+                              Cmp cmp,
+                              const NaturalMergeSortOptions& options,
+                              std::true_type)
+{
+    {
+        external_record_file<T> file(EXTERNAL_SORT_PATH, "wb");
+        file.write(array.data(), array.size());
+        file.close();
+    }
+
+    // A chunk takes half of the budget.
+    ExternalSortOptions external_options;
+    external_options.memory_budget =
+            std::max(2 * array.size() / EXTERNAL_SORT_CHUNKS, (size_t) 2)
+            * sizeof(T);
+    external_options.io_block_size =
+            external_options.memory_budget / (2 * (EXTERNAL_SORT_FAN_IN + 1));
+    external_options.merge_fan_in = EXTERNAL_SORT_FAN_IN;
+    external_options.sort_options = options;
+
+    external_natural_merge_sort<T>(EXTERNAL_SORT_PATH,
+                                   EXTERNAL_SORT_PATH,
+                                   cmp,
+                                   external_options);
+
+    external_record_file<T> file(EXTERNAL_SORT_PATH, "rb");
+    file.read(array.data(), array.size());
+    file.close();
+    std::remove(EXTERNAL_SORT_PATH);
+}
+
+template<class T, class Cmp>
+static void run_external_sort(std::vector<T>&,
+                              Cmp,
+                              const NaturalMergeSortOptions&,
+                              std::false_type)
+{
+    // Not run for the types that cannot be written as raw bytes.
 }
 
 /*******************************************************************************
-* Returns a strongly presorted array of integers.                              *
+* Sorts 'array' with 'distributed_natural_merge_sort', giving each of the      *
+* 'DISTRIBUTED_SORT_NODES' nodes an equal slice of it in order, and gathers    *
+* the sorted slices back.                                                      *
 *******************************************************************************/
-static int* get_presorted_int_array(const size_t length)
+template<class T, class Cmp>
+static void run_distributed_sort(std::vector<T>& array,
+                                 Cmp cmp,
+                                 const NaturalMergeSortOptions& options,
+                                 std::true_type)
 {
-    int* array = new int[length];
-    int num = 0;
+    std::vector<std::vector<T>> slices(DISTRIBUTED_SORT_NODES);
+
+    for (size_t rank = 0; rank != DISTRIBUTED_SORT_NODES; ++rank)
+    {
+        slices[rank].assign(
+                array.begin() + array.size() * rank / DISTRIBUTED_SORT_NODES,
+                array.begin() + array.size() * (rank + 1)
+                                / DISTRIBUTED_SORT_NODES);
+    }
 
-    for (size_t i = 0; i < length / 2; ++i)
+    DistributedSortOptions distributed_options;
+    distributed_options.sort_options = options;
+    ThreadTransportHub hub(DISTRIBUTED_SORT_NODES);
+    std::vector<std::thread> nodes;
+
+    for (size_t rank = 0; rank != DISTRIBUTED_SORT_NODES; ++rank)
     {
-        array[i] = num++;
+        nodes.emplace_back([&, rank]()
+        {
+            ThreadTransport transport(hub, rank);
+            distributed_natural_merge_sort(slices[rank],
+                                           cmp,
+                                           transport,
+                                           distributed_options);
+        });
     }
 
-    for (size_t i = length / 2; i < length; ++i)
+    array.clear();
+
+    for (size_t rank = 0; rank != DISTRIBUTED_SORT_NODES; ++rank)
     {
-        array[i] = num--;
+        nodes[rank].join();
+        array.insert(array.end(), slices[rank].begin(), slices[rank].end());
     }
+}
 
-    return array;
+template<class T, class Cmp>
+static void run_distributed_sort(std::vector<T>&,
+                                 Cmp,
+                                 const NaturalMergeSortOptions&,
+                                 std::false_type)
+{
+    // Not run for the types that cannot be sent as raw bytes.
 }
 
 /*******************************************************************************
-* Returns the milliseconds since the Unix epoch.                               *
+* Returns true if 'algorithm' only sorts the trivially copyable types.         *
 *******************************************************************************/
-static unsigned long long get_milliseconds()
+static bool needs_trivially_copyable(const Algorithm algorithm)
 {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(
-           std::chrono::system_clock::now().time_since_epoch()).count();
+    return algorithm == Algorithm::EXTERNAL_NATURAL_MERGE_SORT ||
+           algorithm == Algorithm::DISTRIBUTED_NATURAL_MERGE_SORT;
 }
 
 /*******************************************************************************
-* Profiles the 'std::stable_sort' agains the range ['begin', 'end') using the  *
-* comparator 'cmp'.                                                            *
+* Sorts 'array' with 'algorithm'. The first 'sorted_prefix' elements of the    *
+* array are sorted, which only 'NATURAL_MERGE_SORT_APPEND' takes advantage of. *
 *******************************************************************************/
 template<class T, class Cmp>
-static void profile_stable_sort(T begin, T end, Cmp cmp)
+static void run_algorithm(const Algorithm algorithm,
+                          std::vector<T>& array,
+                          const size_t sorted_prefix,
+                          Cmp cmp,
+                          const NaturalMergeSortOptions& options)
 {
-    unsigned long long ta = get_milliseconds();
-    std::stable_sort(begin, end, cmp);
-    unsigned long long tb = get_milliseconds();
-
-    std::cout << "std::stable_sort in "
-              << (tb - ta)
-              << " milliseconds. "
-              << "Sorted: "
-              << std::is_sorted(begin, end, cmp)
-              << std::endl;
+    switch (algorithm)
+    {
+        case Algorithm::STD_SORT:
+            std::sort(array.begin(), array.end(), cmp);
+            break;
+
+        case Algorithm::STD_STABLE_SORT:
+            std::stable_sort(array.begin(), array.end(), cmp);
+            break;
+
+        case Algorithm::STD_PARALLEL_STABLE_SORT:
+#ifdef BENCHMARK_PARALLEL_STL
+            std::stable_sort(std::execution::par,
+                             array.begin(),
+                             array.end(),
+                             cmp);
+#endif
+            break;
+
+        case Algorithm::NATURAL_MERGE_SORT:
+            natural_merge_sort(array.begin(), array.end(), cmp, options);
+            break;
+
+        case Algorithm::PARALLEL_NATURAL_MERGE_SORT:
+            parallel_natural_merge_sort(array.begin(),
+                                        array.end(),
+                                        cmp,
+                                        options);
+            break;
+
+        case Algorithm::NATURAL_MERGE_SORT_APPEND:
+            natural_merge_sort_append(array.begin(),
+                                      array.begin() + sorted_prefix,
+                                      array.end(),
+                                      cmp,
+                                      options);
+            break;
+
+        case Algorithm::NATURAL_MERGE_SORT_UNSTABLE:
+        {
+            NaturalMergeSortOptions unstable_options = options;
+            unstable_options.stable = false;
+            natural_merge_sort(array.begin(),
+                               array.end(),
+                               cmp,
+                               unstable_options);
+            break;
+        }
+
+        case Algorithm::NATURAL_MERGE_SORT_INDIRECT:
+            natural_merge_sort_indirect(array.begin(),
+                                        array.end(),
+                                        cmp,
+                                        options);
+            break;
+
+        case Algorithm::EXTERNAL_NATURAL_MERGE_SORT:
+            run_external_sort(array,
+                              cmp,
+                              options,
+                              typename std::is_trivially_copyable<T>::type());
+            break;
+
+        case Algorithm::DISTRIBUTED_NATURAL_MERGE_SORT:
+            run_distributed_sort(
+                    array,
+                    cmp,
+                    options,
+                    typename std::is_trivially_copyable<T>::type());
+            break;
+    }
 }
 
 /*******************************************************************************
-* Profiles the 'natural_merge_sort' agains the range ['begin', 'end') using    *
-* the comparator 'cmp'.                                                        *
+* Returns true if 'array' is sorted like 'reference', the output of a stable   *
+* sort of the same input. An unstable algorithm only needs to put equivalent   *
+* elements in the same places.                                                 *
 *******************************************************************************/
 template<class T, class Cmp>
-void profile_natural_merge_sort(T begin, T end, Cmp cmp)
+static bool is_correct(const Algorithm algorithm,
+                       const std::vector<T>& array,
+                       const std::vector<T>& reference,
+                       Cmp cmp)
 {
-    unsigned long long ta = get_milliseconds();
-    natural_merge_sort(begin, end, cmp);
-    unsigned long long tb = get_milliseconds();
-
-    std::cout << "natural_merge_sort in "
-              << (tb - ta)
-              << " milliseconds. "
-              << "Sorted: "
-              << std::is_sorted(begin, end, cmp)
-              << std::endl;
+    if (algorithm != Algorithm::STD_SORT &&
+        algorithm != Algorithm::NATURAL_MERGE_SORT_UNSTABLE)
+    {
+        return array == reference;
+    }
+
+    for (size_t i = 0; i != array.size(); ++i)
+    {
+        if (cmp(array[i], reference[i]) || cmp(reference[i], array[i]))
+        {
+            return false;
+        }
+    }
+
+    return true;
 }
 
 /*******************************************************************************
-* Profiles the 'natural_merge_sort' agains the range ['begin', 'end') using    *
-* the comparator 'cmp'.                                                        *
+* Times 'algorithm' on 'input' over the warmup and the timed trials of         *
+* 'settings', sorting a fresh copy of the input in every trial, and checks the *
+* output of the first trial against 'reference'.                               *
 *******************************************************************************/
 template<class T, class Cmp>
-void profile_parallel_natural_merge_sort(T begin, T end, Cmp cmp)
+static BenchmarkResult time_algorithm(const Algorithm algorithm,
+                                      const std::vector<T>& input,
+                                      const std::vector<T>& reference,
+                                      const size_t sorted_prefix,
+                                      Cmp cmp,
+                                      const BenchmarkSettings& settings)
 {
-    unsigned long long ta = get_milliseconds();
-    parallel_natural_merge_sort(begin, end, cmp);
-    unsigned long long tb = get_milliseconds();
-
-    std::cout << "parallel_natural_merge_sort in "
-              << (tb - ta)
-              << " milliseconds. "
-              << "Sorted: "
-              << std::is_sorted(begin, end, cmp)
-              << std::endl;
+    BenchmarkResult result;
+    result.algorithm = algorithm;
+    result.length = input.size();
+    result.trials = settings.trials;
+    result.correct = true;
+
+    std::vector<long long> durations;
+    std::vector<T> array;
+
+    for (size_t trial = 0; trial != settings.warmup + settings.trials; ++trial)
+    {
+        array = input;
+
+        const std::chrono::steady_clock::time_point start =
+                std::chrono::steady_clock::now();
+
+        run_algorithm(algorithm,
+                      array,
+                      sorted_prefix,
+                      cmp,
+                      settings.sort_options);
+
+        const std::chrono::steady_clock::time_point finish =
+                std::chrono::steady_clock::now();
+
+        if (trial == 0)
+        {
+            result.correct = is_correct(algorithm, array, reference, cmp);
+        }
+
+        if (trial >= settings.warmup)
+        {
+            durations.push_back(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            finish - start).count());
+        }
+    }
+
+    std::sort(durations.begin(), durations.end());
+    const size_t middle = durations.size() / 2;
+
+    result.median = durations.size() % 2 == 1 ?
+                    durations[middle] :
+                    (durations[middle - 1] + durations[middle]) / 2;
+    result.minimum = durations.front();
+    result.maximum = durations.back();
+    return result;
 }
 
-bool ptr_cmp(int* a, int* b)
+/*******************************************************************************
+* Runs the benchmarks of 'settings' on the element type of 'elements', over    *
+* all the sizes, input shapes and algorithms chosen.                           *
+*******************************************************************************/
+template<class Elements>
+static void benchmark_type(Elements elements,
+                           const BenchmarkSettings& settings,
+                           ResultWriter& writer)
 {
-    return *a < *b;
+    typedef typename Elements::value_type value_type;
+    typename Elements::compare cmp;
+
+    for (size_t length = settings.min_size; length <= settings.max_size;)
+    {
+        if (length > settings.max_bytes /
+                     (COPIES_PER_CELL * Elements::bytes()))
+        {
+            std::cerr << "Skipping " << Elements::name()
+                      << " arrays of length " << length
+                      << ", which would exceed the memory limit."
+                      << std::endl;
+            break;
+        }
+
+        for (size_t s = 0; s != INPUT_SHAPE_AMOUNT; ++s)
+        {
+            if (!settings.shapes[s])
+            {
+                continue;
+            }
+
+            const InputShape shape = (InputShape) s;
+            const std::vector<value_type> input =
+                    elements.make(get_input_keys(shape,
+                                                 length,
+                                                 settings.seed));
+
+            std::vector<value_type> reference = input;
+            std::stable_sort(reference.begin(), reference.end(), cmp);
+
+            for (size_t a = 0; a != ALGORITHM_AMOUNT; ++a)
+            {
+                const Algorithm algorithm = (Algorithm) a;
+
+                if (!settings.algorithms[a] ||
+                    (algorithm == Algorithm::NATURAL_MERGE_SORT_APPEND &&
+                     shape != InputShape::APPEND_TAIL) ||
+                    (needs_trivially_copyable(algorithm) &&
+                     !std::is_trivially_copyable<value_type>::value))
+                {
+                    continue;
+                }
+
+                BenchmarkResult result =
+                        time_algorithm(algorithm,
+                                       input,
+                                       reference,
+                                       get_sorted_prefix(shape, length),
+                                       cmp,
+                                       settings);
+                result.type = Elements::name();
+                result.shape = shape;
+                writer.write(result);
+            }
+        }
+
+        if (length > settings.max_size / settings.size_factor)
+        {
+            break;
+        }
+
+        length *= settings.size_factor;
+    }
 }
 
 /*******************************************************************************
-* Profiles the sorting algorithms on a random integer array.                   *
+* Splits 'text' at the commas.                                                 *
 *******************************************************************************/
-static void profile_on_random_array(const size_t sz,
-                                    const int minimum,
-                                    const int maximum,
-                                    const unsigned seed)
+static std::vector<std::string> split_list(const std::string& text)
 {
-    int* array1 = get_random_int_array(sz, minimum, maximum, seed);
-    int* array2 = new int[sz];
-    int* array3 = new int[sz];
-
-    std::copy(array1, array1 + sz, array2);
-    std::copy(array1, array1 + sz, array3);
-
-    std::cout << "--- PROFILING ON RANDOM ARRAY OF LENGTH "
-              << sz
-              << " ---"
-              << std::endl;
-
-    profile_stable_sort(array1, 
-                        array1 + sz, 
-                        std::less<int>());
-
-    profile_natural_merge_sort(array2, 
-                               array2 + sz, 
-                               std::less<int>());
-
-    profile_parallel_natural_merge_sort(array3,
-                                        array3 + sz,
-                                        std::less<int>());
-
-    std::cout << "Same contents: "
-              << (std::equal(array1, array1 + sz, array2)
-                 && std::equal(array1, array1 + sz, array3))
-              << std::endl
-              << std::endl;
+    std::vector<std::string> items;
+    size_t begin = 0;
+
+    while (true)
+    {
+        const size_t comma = text.find(',', begin);
+        items.push_back(text.substr(begin, comma - begin));
+
+        if (comma == std::string::npos)
+        {
+            return items;
+        }
+
+        begin = comma + 1;
+    }
 }
 
 /*******************************************************************************
-* Profiles the sorting algorithms on an array of pointers to random integers.  *
+* Parses a count, which may end in 'K', 'M' or 'G' for the powers of 1000.     *
+* Returns false if 'text' is not such a count.                                 *
 *******************************************************************************/
-static void profile_on_integer_pointer_array(const size_t sz,
-                                             const int minimum,
-                                             const int maximum,
-                                             const unsigned seed)
+static bool parse_count(const std::string& text, size_t& count)
 {
-    std::cout << "--- PROFILING ON RANDOM POINTER ARRAY OF LENGTH "
-              << sz
-              << " ---"
-              << std::endl;
-
-    int** array1 = get_random_int_pointer_array(sz,
-                                                minimum,
-                                                maximum,
-                                                seed);
-    int** array2 = new int*[sz];
-    int** array3 = new int*[sz];
-
-    std::copy(array1, array1 + sz, array2);
-    std::copy(array1, array1 + sz, array3);
-
-    auto lam = [](int* a, int* b) { return *a < *b; };
-    
-    profile_stable_sort(array1, 
-                        array1 + sz, 
-                        ptr_cmp);
-
-    profile_natural_merge_sort(array2, 
-                               array2 + sz,
-                               ptr_cmp);
-
-    profile_parallel_natural_merge_sort(array3,
-                                        array3 + sz,
-                                        ptr_cmp);
-    std::cout << "Same contents: "
-              << (std::equal(array1, array1 + sz, array2)
-                 && std::equal(array1, array1 + sz, array3))
-              << std::endl
-              << std::endl;
+    char* end;
+    const unsigned long long value = std::strtoull(text.c_str(), &end, 10);
+    unsigned long long multiplier = 1;
+
+    if (end == text.c_str())
+    {
+        return false;
+    }
+
+    switch (*end)
+    {
+        case 'K': case 'k': multiplier = 1000ULL; ++end; break;
+        case 'M': case 'm': multiplier = 1000000ULL; ++end; break;
+        case 'G': case 'g': multiplier = 1000000000ULL; ++end; break;
+    }
+
+    count = (size_t) (value * multiplier);
+    return *end == '\0';
 }
 
 /*******************************************************************************
-* Profiles the sorting algorithms on a presorted array.                        *
+* Selects the names of 'list' among the 'amount' names of 'names'. Returns     *
+* false if the list names something else.                                      *
 *******************************************************************************/
-static void profile_on_presorted_array(const size_t sz)
+static bool parse_selection(const std::string& list,
+                            const char* const* names,
+                            const size_t amount,
+                            bool* selected)
 {
-    std::cout << "--- PROFILING ON PRESORTED ARRAY OF LENGTH "
-              << sz
-              << " ---"
-              << std::endl;
-
-    int* array1 = get_presorted_int_array(sz);
-    int* array2 = new int[sz];
-    int* array3 = new int[sz];
-
-    std::copy(array1, array1 + sz, array2);
-    std::copy(array1, array1 + sz, array3);
-
-    profile_stable_sort(array1, 
-                        array1 + sz, 
-                        std::less<int>());
-
-    profile_natural_merge_sort(array2, 
-                               array2 + sz, 
-                               std::less<int>());
-
-    profile_parallel_natural_merge_sort(array3,
-                                        array3 + sz,
-                                        std::less<int>());
-
-    std::cout << "Same contents: "
-              << (std::equal(array1, array1 + sz, array2) 
-                 && std::equal(array1, array1 + sz, array3))
-              << std::endl
-              << std::endl;
+    std::fill(selected, selected + amount, false);
+
+    for (const std::string& item : split_list(list))
+    {
+        const char* const* name = std::find(names, names + amount, item);
+
+        if (name == names + amount)
+        {
+            return false;
+        }
+
+        selected[name - names] = true;
+    }
+
+    return true;
+}
+
+static void print_usage(const char* program)
+{
+    std::cerr
+        << "Usage: " << program << " [OPTION]...\n"
+        << "Benchmarks the natural merge sorts against the standard sorts "
+        << "and prints the\nmedian times as CSV.\n\n"
+        << "  --types=LIST        int,int64,double,pointer,record64,string\n"
+        << "  --inputs=LIST       random,few_distinct,sorted,reversed,"
+        << "sawtooth,\n"
+        << "                      organ_pipe,k_sorted,append_tail\n"
+        << "  --algorithms=LIST   std::sort,std::stable_sort,"
+        << "std::stable_sort(par),\n"
+        << "                      natural_merge_sort,"
+        << "parallel_natural_merge_sort,\n"
+        << "                      natural_merge_sort_append,"
+        << "natural_merge_sort(unstable),\n"
+        << "                      natural_merge_sort(indirect),"
+        << "external_natural_merge_sort,\n"
+        << "                      distributed_natural_merge_sort\n"
+        << "  --min-size=N        the shortest input, 1K by default\n"
+        << "  --max-size=N        the longest input, 1M by default, up to 1G\n"
+        << "  --size-factor=N     the ratio of the consecutive sizes, 10\n"
+        << "  --warmup=N          the untimed trials per cell, 1\n"
+        << "  --trials=N          the timed trials per cell, 5\n"
+        << "  --max-bytes=N       skip larger arrays than fit in N bytes, "
+        << "4G\n"
+        << "  --threads=N         the threads of the parallel sort, all CPUs\n"
+        << "  --seed=N            the seed of the random inputs, 1\n"
+        << "  --format=csv|json   the output format, csv\n\n"
+        << "Sizes may end in K, M or G for the powers of 1000. The "
+        << "parallel standard\nsort is available when built with "
+        << "-std=c++17 -DBENCHMARK_PARALLEL_STL.\n";
+}
+
+/*******************************************************************************
+* Parses the command line into 'settings'. Returns false on an invalid option. *
+*******************************************************************************/
+static bool parse_arguments(const int argc,
+                            const char* argv[],
+                            BenchmarkSettings& settings)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string argument = argv[i];
+        const size_t equals = argument.find('=');
+
+        if (equals == std::string::npos)
+        {
+            return false;
+        }
+
+        const std::string key = argument.substr(0, equals);
+        const std::string value = argument.substr(equals + 1);
+        size_t count = 0;
+        bool valid = true;
+
+        if (key == "--types")
+        {
+            settings.types = split_list(value);
+
+            for (const std::string& type : settings.types)
+            {
+                valid = valid && std::find(TYPE_NAMES,
+                                           TYPE_NAMES + TYPE_AMOUNT,
+                                           type) != TYPE_NAMES + TYPE_AMOUNT;
+            }
+        }
+        else if (key == "--inputs")
+        {
+            valid = parse_selection(value,
+                                    INPUT_SHAPE_NAMES,
+                                    INPUT_SHAPE_AMOUNT,
+                                    settings.shapes);
+        }
+        else if (key == "--algorithms")
+        {
+            valid = parse_selection(value,
+                                    ALGORITHM_NAMES,
+                                    ALGORITHM_AMOUNT,
+                                    settings.algorithms);
+#ifndef BENCHMARK_PARALLEL_STL
+            valid = valid && !settings.algorithms[
+                    (size_t) Algorithm::STD_PARALLEL_STABLE_SORT];
+#endif
+        }
+        else if (key == "--format")
+        {
+            valid = value == "csv" || value == "json";
+            settings.json = value == "json";
+        }
+        else if (!parse_count(value, count))
+        {
+            valid = false;
+        }
+        else if (key == "--min-size")
+        {
+            settings.min_size = count;
+            valid = count > 0;
+        }
+        else if (key == "--max-size")
+        {
+            settings.max_size = count;
+        }
+        else if (key == "--size-factor")
+        {
+            settings.size_factor = count;
+            valid = count > 1;
+        }
+        else if (key == "--warmup")
+        {
+            settings.warmup = count;
+        }
+        else if (key == "--trials")
+        {
+            settings.trials = count;
+            valid = count > 0;
+        }
+        else if (key == "--max-bytes")
+        {
+            settings.max_bytes = count;
+        }
+        else if (key == "--threads")
+        {
+            settings.sort_options.thread_count = count;
+        }
+        else if (key == "--seed")
+        {
+            settings.seed = (unsigned) count;
+        }
+        else
+        {
+            valid = false;
+        }
+
+        if (!valid)
+        {
+            std::cerr << "Invalid option '" << argument << "'." << std::endl;
+            return false;
+        }
+    }
+
+    return true;
 }
 
 /*******************************************************************************
-* The entry point to a demo program.                                           *
+* The entry point to the benchmark program.                                    *
 *******************************************************************************/
 int main(int argc, const char * argv[]) {
-    unsigned long long seed = get_milliseconds();
+    BenchmarkSettings settings;
 
-    std::cout << "Seed: "
-              << seed
-              << std::endl
-              << std::endl;
+    if (argc == 2 && std::string(argv[1]) == "--help")
+    {
+        print_usage(argv[0]);
+        return 0;
+    }
 
-    const size_t length = 5000000;
-    const int min_int = -100;
-    const int max_int = 300;
+    if (!parse_arguments(argc, argv, settings))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
 
-    std::cout << std::boolalpha;
+    ResultWriter writer(settings.json);
 
-    profile_on_random_array(length, min_int, max_int, seed);
-    profile_on_integer_pointer_array(length, min_int, max_int, seed);
-    profile_on_presorted_array(length);
+    for (const std::string& type : settings.types)
+    {
+        if (type == "int")
+        {
+            benchmark_type(IntElements(), settings, writer);
+        }
+        else if (type == "int64")
+        {
+            benchmark_type(Int64Elements(), settings, writer);
+        }
+        else if (type == "double")
+        {
+            benchmark_type(DoubleElements(), settings, writer);
+        }
+        else if (type == "pointer")
+        {
+            benchmark_type(PointerElements(), settings, writer);
+        }
+        else if (type == "record64")
+        {
+            benchmark_type(Record64Elements(), settings, writer);
+        }
+        else
+        {
+            benchmark_type(StringElements(), settings, writer);
+        }
+    }
 
-    return 0;
+    return writer.failures() == 0 ? 0 : 1;
 }
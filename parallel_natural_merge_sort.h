@@ -2,8 +2,25 @@
 #define NATURAL_MERGE_SORT_H
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iterator>
-#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 #define USE_POSIX_THREADS
 
@@ -11,16 +28,266 @@
 #include <pthread.h>
 #endif
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // Include 'thread' for 'hardware_concurrency'.
 #include <thread> 
 
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// The standard execution policies are accepted since C++17.
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<execution>)
+#include <execution>
+#define NATURAL_MERGE_SORT_STD_EXECUTION
+#endif
+#endif
+
+// The parallel sort may be awaited in a coroutine since C++20.
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine) && \
+    defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define NATURAL_MERGE_SORT_COROUTINES
+#endif
+#endif
+
 static constexpr size_t MINIMUM_CAPACITY = 256;
 
+// At least 16384 elements per thread, unless the options give another grain.
+static constexpr size_t MINIMUM_THREAD_LOAD = 1 << 14;
+
+// A merge switches to galloping after one run wins this many times in a row.
+static constexpr size_t MINIMUM_GALLOP = 7;
+
+// The vectorized run scanner compares this many pairs one at a time first.
+static constexpr std::ptrdiff_t SCALAR_SCAN_PREFIX = 4;
+
+// A radix sort pass over a range takes about as long as this many merge passes.
+static constexpr double RADIX_SORT_PASS_COST = 3;
+
+// The amount of runs the loser tree merges at a time by default.
+static constexpr size_t DEFAULT_MERGE_FAN_IN = 8;
+
+// A merge block and its slice of the buffer take half of a 1 MiB L2 cache.
+static constexpr size_t DEFAULT_MERGE_BLOCK_BYTES = 1 << 18;
+
+// A good minimum run length for the insertion sort extending the short runs.
+static constexpr size_t RECOMMENDED_MINIMUM_RUN_LENGTH = 32;
+
+// The smallest page size, at which the scratch buffer is first touched.
+static constexpr size_t FIRST_TOUCH_STRIDE = 4096;
+
+// The amount of chunks a parallel sort cuts per thread by default.
+static constexpr size_t DEFAULT_TASKS_PER_THREAD = 4;
+
+// The presortedness probe scans this many windows of the range, each of
+// 'PROBE_WINDOW_LENGTH' elements.
+static constexpr size_t PROBE_WINDOW_AMOUNT = 16;
+static constexpr size_t PROBE_WINDOW_LENGTH = 32;
+
+// The probe would cost a notable share of sorting a shorter range.
+static constexpr size_t PROBE_MINIMUM_LENGTH = 4096;
+
+// The probe takes a range whose sampled runs are shorter on average for
+// random, and one whose sampled runs are at least 'PROBE_LONG_RUN_LENGTH'
+// long for presorted.
+static constexpr size_t PROBE_SHORT_RUN_LENGTH = 8;
+static constexpr size_t PROBE_LONG_RUN_LENGTH = 16;
+
+// The run length histogram has a bucket per power of two.
+static constexpr size_t RUN_LENGTH_HISTOGRAM_BUCKETS = 64;
+
+class ThreadPool;
+struct NaturalMergeSortStats;
+
+/*******************************************************************************
+* Receives the progress of a sort as the amount of its units of work done and  *
+* the total amount of them.                                                    *
+*******************************************************************************/
+typedef std::function<void(size_t done, size_t total)> NaturalMergeSortProgress;
+
+/*******************************************************************************
+* Lists the orders in which the natural merge sort may merge the runs.         *
+*                                                                              *
+* 'FIFO_QUEUE' merges the two runs at the head of the run queue and appends    *
+* the result to its tail, so that every merge pass moves the entire range      *
+* between the range and the buffer.                                            *
+*                                                                              *
+* 'POWERSORT' keeps a stack of runs and merges neighbouring runs in the order  *
+* given by the powers of their boundaries, as in Powersort by Munro and Wild.  *
+* Each merge moves only the shorter of the two runs to the buffer, and the     *
+* total merge cost is within a constant of the entropy of the run lengths, so  *
+* that a long run is not moved again for every few short runs after it.        *
+*                                                                              *
+* 'LOSER_TREE' works like 'FIFO_QUEUE', but merges up to 'merge_fan_in' runs   *
+* at a time with a tournament tree of losers, so that the range is moved       *
+* log2(merge_fan_in) times fewer between the range and the buffer. This pays   *
+* off for large elements, whose moves cost more than the comparisons; small    *
+* arithmetic elements merge faster pairwise, where the merges may use the      *
+* branchless or the vector kernels.                                            *
+*******************************************************************************/
+enum class RunMergePolicy {
+    FIFO_QUEUE,
+    POWERSORT,
+    LOSER_TREE
+};
+
+/*******************************************************************************
+* Collects the options of the natural merge sorts. The sequential sorts        *
+* ignore the options concerning threads.                                       *
+*******************************************************************************/
+struct NaturalMergeSortOptions {
+
+    // If not null, the sort runs in the threads of this pool instead of
+    // spawning new threads.
+    ThreadPool* p_pool;
+
+    // The most threads the parallel sorts use, counting the calling thread.
+    // Zero means one per pool thread and the calling thread if 'p_pool' is
+    // set, and one per CPU available to the process otherwise. The range is
+    // cut into chunks of equal length for any amount of threads.
+    size_t thread_count;
+
+    // The fewest elements a thread is given to sort, merge, scan or reverse;
+    // a shorter range is left to fewer threads. A larger grain trades
+    // parallelism for less synchronization.
+    size_t grain_size;
+
+    // The amount of chunks the parallel sorts cut per thread, and of pieces
+    // per thread every parallel merge is split into, as long as they stay
+    // within the grain size. The idle threads steal the pending tasks from
+    // the busy ones, so that a thread done early with a cheap, say presorted,
+    // chunk takes over a share of the work left. One gives every thread a
+    // single chunk.
+    size_t tasks_per_thread;
+
+    // If true, the runs are scanned in parallel up front and the chunks are
+    // cut along the run boundaries, so that long runs are not cut into pieces
+    // that have to be merged back.
+    bool run_aware_partitioning;
+
+    // The order in which the runs are merged.
+    RunMergePolicy merge_policy;
+
+    // If not zero, the 'FIFO_QUEUE' and the 'LOSER_TREE' policies first merge
+    // the runs within blocks of consecutive runs of at most this many bytes
+    // until each block is a single run, and only then merge the blocks. The
+    // early passes then stay within a block and its slice of the buffer,
+    // which should fit in the L2 cache, instead of sweeping the whole range
+    // through the memory. The raw buffers of the types that need to be
+    // constructed are not blocked.
+    size_t merge_block_bytes;
+
+    // The amount of runs the 'LOSER_TREE' policy merges at a time. The tree
+    // holds this many runs, so the fan-in should keep the heads of the runs
+    // resident in the L1 or the L2 cache.
+    size_t merge_fan_in;
+
+    // If greater than one, the natural runs shorter than this are extended
+    // to this length by insertion sort before they are queued. Values
+    // around 'RECOMMENDED_MINIMUM_RUN_LENGTH' save the first few merge passes
+    // on random data. Does not apply to the prescanned runs of the run-aware
+    // partitioning.
+    size_t minimum_run_length;
+
+    // If true, every thread of a parallel sort writes to each page of the
+    // slice of the scratch buffer belonging to its chunk before sorting the
+    // chunk. A fresh buffer then has its pages on the NUMA nodes of the
+    // threads that sort into them, so that only the merges across the chunks
+    // cross the nodes. Combine with a pool spreading its threads over the
+    // nodes. The caller-supplied buffers of non-trivial types are not
+    // touched, as their elements may not be overwritten byte by byte.
+    bool numa_first_touch;
+
+    // The most elements of scratch space the sorts may use. If a range needs
+    // more, its runs are merged in place in the order of Powersort: a merge
+    // moves the shorter run to the scratch space if it fits, and otherwise
+    // splits the runs by rotation until the pieces do, so that a budget of
+    // zero needs no scratch space at all. The sorts stay stable, but the
+    // smaller the budget, the slower they get. The run-aware partitioning and
+    // the radix sort are not used under a budget, as they need the full range
+    // of scratch space or a list of all the runs.
+    size_t scratch_budget;
+
+    // If true, the sorts sample the run lengths of a range before scanning
+    // its runs. A range of short runs is radix sorted up front if its keys
+    // allow and that takes fewer passes, and has its runs extended to
+    // 'RECOMMENDED_MINIMUM_RUN_LENGTH' otherwise, unless 'minimum_run_length'
+    // asks for another length. The parallel sort cuts a range of long runs
+    // along the run boundaries as with 'run_aware_partitioning', and every
+    // chunk of any other range probes its own runs.
+    bool presortedness_probe;
+
+    // If false, the sorts need not keep equal elements in their order. The
+    // non-increasing runs are then reversed like the strictly descending
+    // ones, so that descending data with repeated keys makes long runs
+    // instead of many short ones. Does not apply to the prescanned runs of
+    // the run-aware partitioning.
+    bool stable;
+
+    // If not null and set, the sorts stop early, leaving the elements of the
+    // range in an unspecified order. The flag is checked before each merge
+    // pass and each merge block, before each merge of two runs under the
+    // Powersort policy, and before each chunk and each merge of the chunks
+    // of a parallel sort. The radix sort and the sorts under a scratch
+    // budget run to the end.
+    const std::atomic<bool>* p_cancel;
+
+    // If not null, set to true when a sort finds 'p_cancel' set and leaves
+    // work undone because of it. A sort that finishes before the flag is set
+    // does not touch it.
+    std::atomic<bool>* p_stopped;
+
+    // If not null, called after each unit of work with the amount of units
+    // done and the total amount of them. A sequential sort counts its merge
+    // passes as given by 'get_pass_amount', with all the merges within the
+    // blocks counting as one pass, or under the Powersort policy its merges
+    // of two runs, one fewer than the runs. A parallel sort of several
+    // chunks counts the chunks it sorts and the merges of the chunks. The
+    // calls may come from any thread of the sort, but never at the same
+    // time.
+    const NaturalMergeSortProgress* p_progress;
+
+    // If not null, the sorts record their statistics here. See
+    // 'NaturalMergeSortStats'.
+    NaturalMergeSortStats* p_stats;
+
+    NaturalMergeSortOptions() :
+    p_pool{nullptr},
+    thread_count{0},
+    grain_size{MINIMUM_THREAD_LOAD},
+    tasks_per_thread{DEFAULT_TASKS_PER_THREAD},
+    run_aware_partitioning{false},
+    merge_policy{RunMergePolicy::FIFO_QUEUE},
+    merge_block_bytes{DEFAULT_MERGE_BLOCK_BYTES},
+    merge_fan_in{DEFAULT_MERGE_FAN_IN},
+    minimum_run_length{1},
+    numa_first_touch{false},
+    scratch_budget{std::numeric_limits<size_t>::max()},
+    presortedness_probe{true},
+    stable{true},
+    p_cancel{nullptr},
+    p_stopped{nullptr},
+    p_progress{nullptr},
+    p_stats{nullptr}
+    {}
+};
+
 /*******************************************************************************
-* Implements a simple, array-based queue of integers. All three operations run *
-* in constant time. This queue, however, does not check for under-/overflow of *
-* underlying buffer because of performance considerations.                     *
+* Implements a simple, array-based queue of integers of type 'Int'. All three  *
+* operations run in amortized constant time. The underlying buffer starts      *
+* small and doubles whenever it becomes full, so that the memory held by the   *
+* queue is proportional to the amount of integers in it. This queue, however,  *
+* does not check for underflow because of performance considerations.          *
 *******************************************************************************/
+template<class Int = size_t>
 class UnsafeIntQueue {
 private:
     
@@ -28,7 +295,7 @@ private:
     size_t m_tail;
     size_t m_size;
     size_t m_mask;
-    size_t* m_buffer;
+    Int* m_buffer;
 
     /***************************************************************************
     * Makes sure a capacity is at least 'MINIMUM_CAPACITY' and is a power of   *
@@ -47,22 +314,46 @@ private:
         return s;
     }
 
+    /***************************************************************************
+    * Doubles the capacity of the underlying buffer. The integers are moved to *
+    * the beginning of the new buffer in queue order.                          *
+    ***************************************************************************/
+    void grow()
+    {
+        const size_t capacity = m_mask + 1;
+        Int* buffer = new Int[2 * capacity];
+
+        for (size_t i = 0; i != m_size; ++i)
+        {
+            buffer[i] = m_buffer[(m_head + i) & m_mask];
+        }
+
+        delete[] m_buffer;
+        m_buffer = buffer;
+        m_mask = 2 * capacity - 1;
+        m_head = 0;
+        m_tail = m_size;
+    }
+
 public:
 
     /***************************************************************************
-    * Constructs a new integer queue, which can accommodate 'capacit' amount   *
-    * integers.                                                                *
+    * Constructs a new integer queue, which can initially accommodate          *
+    * 'capacity' integers without growing.                                     *
     ***************************************************************************/
-    UnsafeIntQueue(size_t capacity) :
+    explicit UnsafeIntQueue(size_t capacity = MINIMUM_CAPACITY) :
     m_head{0},
     m_tail{0},
     m_size{0}
     {
         capacity = fixCapacity(capacity);
         m_mask = capacity - 1;
-        m_buffer = new size_t[capacity];
+        m_buffer = new Int[capacity];
     }
 
+    UnsafeIntQueue(const UnsafeIntQueue&) = delete;
+    UnsafeIntQueue& operator=(const UnsafeIntQueue&) = delete;
+
     /***************************************************************************
     * Destroys this queue, which releases the underlying buffer.               *
     ***************************************************************************/
@@ -76,7 +367,12 @@ public:
     ***************************************************************************/
     inline void enqueue(const size_t element)
     {
-        m_buffer[m_tail & m_mask] = element;
+        if (m_size > m_mask)
+        {
+            grow();
+        }
+
+        m_buffer[m_tail] = (Int) element;
         m_tail = (m_tail + 1) & m_mask;
         m_size++;
     }
@@ -99,393 +395,6259 @@ public:
     {
         return m_size;
     }
+
+    /***************************************************************************
+    * Returns the 'index'th integer from the head of this queue.               *
+    ***************************************************************************/
+    inline size_t at(const size_t index) const
+    {
+        return m_buffer[(m_head + index) & m_mask];
+    }
 };
 
 /*******************************************************************************
-* Scans the range [first, last) and returns the queue containing sizes of each *
-* run in the order they appear while scanning from left to right.              *
+* Returns true if the run lengths of a range of 'length' elements fit in 32    *
+* bits, so that the run queue may store them in half the space.                *
 *******************************************************************************/
-template<class RandomIt, class Cmp>
-std::unique_ptr<UnsafeIntQueue> build_run_size_queue(RandomIt first,
-                                                     RandomIt last,
-                                                     Cmp cmp)
+inline bool run_lengths_fit_32_bits(const size_t length)
 {
-    const size_t length = std::distance(first, last);
-    UnsafeIntQueue* p_q = new UnsafeIntQueue(length / 2 + 1);
+    return length <= std::numeric_limits<uint32_t>::max();
+}
 
-    RandomIt head;
-    RandomIt left = first;
-    RandomIt right = left + 1;
+/*******************************************************************************
+* Tells whether 'It' is an iterator into contiguous storage of 'T's.           *
+*******************************************************************************/
+template<class It, class T>
+struct is_contiguous_iterator : std::integral_constant<bool,
+        std::is_same<It, T*>::value ||
+        std::is_same<It, const T*>::value ||
+        std::is_same<It, typename std::vector<T>::iterator>::value ||
+        std::is_same<It, typename std::vector<T>::const_iterator>::value> {};
 
-    const RandomIt lst = last - 1;
+/*******************************************************************************
+* Tells whether 'Cmp' orders the 'T's by their built-in 'operator<'.           *
+*******************************************************************************/
+template<class T, class Cmp>
+struct is_standard_less : std::is_same<Cmp, std::less<T>> {};
 
-    while (left < lst)
-    {
-        head = left;
+#if __cplusplus >= 201402L
+template<class T>
+struct is_standard_less<T, std::less<>> : std::true_type {};
+#endif
 
-        if (cmp(*right++, *left++))
-        {
-            // Reading a strictly descending run.
-            while (left < lst && cmp(*right, *left))
-            {
-                ++left;
-                ++right;
-            }
+/*******************************************************************************
+* The amount of adjacent pairs of 'T's the vectorized run scanner compares at  *
+* a time, or zero if 'T' has no vectorized scanner.                            *
+*******************************************************************************/
+template<class T>
+struct simd_scan_lanes : std::integral_constant<size_t, 0> {};
 
-            p_q->enqueue(right - head);
-            std::reverse(head, right);
-        }
-        else
-        {
-            // Reading a ascending run.
-            while (left < lst && !cmp(*right, *left))
-            {
-                ++left;
-                ++right;
-            }
+#if defined(__AVX2__)
+template<>
+struct simd_scan_lanes<int32_t> : std::integral_constant<size_t, 8> {};
 
-            p_q->enqueue(left - head + 1);
-        }
+template<>
+struct simd_scan_lanes<uint32_t> : std::integral_constant<size_t, 8> {};
 
-        ++left;
-        ++right;
-    }
+template<>
+struct simd_scan_lanes<int64_t> : std::integral_constant<size_t, 4> {};
 
-    if (left == lst)
-    {
-        // Handle the case of an orphan element at the end of the range.
-        p_q->enqueue(1);
-    }
+template<>
+struct simd_scan_lanes<uint64_t> : std::integral_constant<size_t, 4> {};
 
-    return std::unique_ptr<UnsafeIntQueue>(p_q);
-}
+template<>
+struct simd_scan_lanes<float> : std::integral_constant<size_t, 8> {};
+
+template<>
+struct simd_scan_lanes<double> : std::integral_constant<size_t, 4> {};
 
 /*******************************************************************************
-* Returns the amount of leading zeros in 'num'.                                *
+* Returns a mask whose bit 'j' is set if and only if 'p[j + 1] < p[j]', for    *
+* every lane 'j' of a vector. Reads 'p[0]' through 'p[lanes]'. The unsigned    *
+* integers are compared as signed ones after flipping their sign bits.         *
 *******************************************************************************/
-size_t leading_zeros(const size_t num)
+inline unsigned simd_descents(const int32_t* p)
 {
-    size_t count = 0;
+    const __m256i current = _mm256_loadu_si256((const __m256i*) p);
+    const __m256i next = _mm256_loadu_si256((const __m256i*) (p + 1));
+    return _mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpgt_epi32(current, next)));
+}
 
-    for (size_t t = (size_t) 1 << (8 * sizeof(t) - 1); t; t >>= 1, ++count)
-    {
-        if ((t & num))
-        {
-            return count;
-        }
-    }
+inline unsigned simd_descents(const uint32_t* p)
+{
+    const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+    const __m256i current = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*) p), bias);
+    const __m256i next = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*) (p + 1)), bias);
+    return _mm256_movemask_ps(
+            _mm256_castsi256_ps(_mm256_cmpgt_epi32(current, next)));
+}
 
-    return count;
+inline unsigned simd_descents(const int64_t* p)
+{
+    const __m256i current = _mm256_loadu_si256((const __m256i*) p);
+    const __m256i next = _mm256_loadu_si256((const __m256i*) (p + 1));
+    return _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(current, next)));
 }
 
-/*******************************************************************************
-* Returns the amount of merge passes needed to sort a range with 'run_amount'  *
-* runs.                                                                        *
-*******************************************************************************/
-size_t get_pass_amount(size_t run_amount)
+inline unsigned simd_descents(const uint64_t* p)
 {
-    return 8 * sizeof(run_amount) - leading_zeros(run_amount - 1);
+    const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i current = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*) p), bias);
+    const __m256i next = _mm256_xor_si256(
+            _mm256_loadu_si256((const __m256i*) (p + 1)), bias);
+    return _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(current, next)));
+}
+
+inline unsigned simd_descents(const float* p)
+{
+    return _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(p + 1),
+                                            _mm256_loadu_ps(p),
+                                            _CMP_LT_OQ));
+}
+
+inline unsigned simd_descents(const double* p)
+{
+    return _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(p + 1),
+                                            _mm256_loadu_pd(p),
+                                            _CMP_LT_OQ));
 }
+#elif defined(__SSE2__)
+template<>
+struct simd_scan_lanes<int32_t> : std::integral_constant<size_t, 4> {};
+
+template<>
+struct simd_scan_lanes<uint32_t> : std::integral_constant<size_t, 4> {};
+
+template<>
+struct simd_scan_lanes<float> : std::integral_constant<size_t, 4> {};
+
+template<>
+struct simd_scan_lanes<double> : std::integral_constant<size_t, 2> {};
 
 /*******************************************************************************
-* The actual implementation of natural merge sort.                             *
+* Returns a mask whose bit 'j' is set if and only if 'p[j + 1] < p[j]', for    *
+* every lane 'j' of a vector. Reads 'p[0]' through 'p[lanes]'. The unsigned    *
+* integers are compared as signed ones after flipping their sign bits. SSE2    *
+* has no 64-bit integer comparison, so those are scanned one pair at a time.   *
 *******************************************************************************/
-template<class RandomIt, class Cmp>
-void natural_merge_sort_impl(RandomIt first, 
-                             RandomIt last, 
-                             RandomIt buffer,
-                             Cmp cmp)
+inline unsigned simd_descents(const int32_t* p)
 {
-    const size_t length = std::distance(first, last);
-
-    if (length < 2)
-    {
-        // Trivially sorted.
-        return;
-    }
+    const __m128i current = _mm_loadu_si128((const __m128i*) p);
+    const __m128i next = _mm_loadu_si128((const __m128i*) (p + 1));
+    return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(current, next)));
+}
 
-    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+inline unsigned simd_descents(const uint32_t* p)
+{
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    const __m128i current =
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*) p), bias);
+    const __m128i next =
+            _mm_xor_si128(_mm_loadu_si128((const __m128i*) (p + 1)), bias);
+    return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(current, next)));
+}
 
-    // Scan the runs.
-    std::unique_ptr<UnsafeIntQueue> p_queue = build_run_size_queue(first, last, cmp);
+inline unsigned simd_descents(const float* p)
+{
+    return _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(p + 1),
+                                        _mm_loadu_ps(p)));
+}
 
-    // Count the amount of merge passes over the array required to bring order.
-    const size_t merge_passes = get_pass_amount(p_queue->size());
+inline unsigned simd_descents(const double* p)
+{
+    return _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(p + 1),
+                                        _mm_loadu_pd(p)));
+}
+#endif
 
-    RandomIt source;
-    RandomIt target;
+/*******************************************************************************
+* Tells whether the runs of a range addressed by 'RandomIt' and ordered by     *
+* 'Cmp' may be scanned with 'simd_descents'. The vector comparisons agree      *
+* with 'operator<' also on NaNs, which never compare less than anything.       *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+struct is_simd_scannable : std::integral_constant<bool,
+        simd_scan_lanes<
+            typename std::iterator_traits<RandomIt>::value_type>::value != 0 &&
+        is_contiguous_iterator<RandomIt,
+            typename std::iterator_traits<RandomIt>::value_type>::value &&
+        is_standard_less<
+            typename std::iterator_traits<RandomIt>::value_type, Cmp>::value>
+{};
 
-    // Make sure that after the last merge pass, all data ends up in the input
-    // container.
-    if ((merge_passes & 1) == 1)
-    {
-        source = buffer;
-        target = first;
-        std::copy(first, last, buffer);
-    }
-    else
+/*******************************************************************************
+* Returns the first 'left' in [left, lst] such that 'left == lst' or           *
+* 'cmp(*(left + 1), *left)', that is, the last element of the ascending run    *
+* running through 'left'.                                                      *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+RandomIt find_ascending_run_end(RandomIt left,
+                                const RandomIt lst,
+                                Cmp cmp,
+                                std::false_type)
+{
+    while (left < lst && !cmp(*(left + 1), *left))
     {
-        source = first;
-        target = buffer;
+        ++left;
     }
 
-    size_t runs_left = p_queue->size();
-    size_t offset = 0;
+    return left;
+}
 
-    // While there is runs to merge, do...
-    while (p_queue->size() > 1)
+template<class RandomIt, class Cmp>
+RandomIt find_ascending_run_end(RandomIt left,
+                                const RandomIt lst,
+                                Cmp cmp,
+                                std::true_type)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    const std::ptrdiff_t lanes = simd_scan_lanes<value_type>::value;
+
+    // Most runs of random data end within a few elements, and a scalar
+    // comparison is cheaper than a vector one for those.
+    for (std::ptrdiff_t i = 0; i < SCALAR_SCAN_PREFIX; ++i)
     {
-        // Remove two runs from the head of the run queue.
-        size_t left_run_length = p_queue->dequeue();
-        size_t right_run_length = p_queue->dequeue();
+        if (left == lst || cmp(*(left + 1), *left))
+        {
+            return left;
+        }
 
-        std::merge(source + offset,
-                   source + offset + left_run_length,
-                   source + offset + left_run_length,
-                   source + offset + left_run_length + right_run_length,
-                   target + offset,
-                   cmp);
+        ++left;
+    }
 
-        // Append the merged run to the tail of the queue.
-        p_queue->enqueue(left_run_length + right_run_length);
-        runs_left -= 2;
-        offset += left_run_length + right_run_length;
+    while (lst - left >= lanes)
+    {
+        const unsigned descents = simd_descents(&*left);
 
-        // The current pass over the array is almost complete.
-        switch (runs_left)
+        if (descents != 0)
         {
-            case 1:
-            {
-                const size_t single_length = p_queue->dequeue();
-
-                std::copy(source + offset,
-                          source + offset + single_length,
-                          target + offset);
+            return left + __builtin_ctz(descents);
+        }
 
-                p_queue->enqueue(single_length);
-            }
+        left += lanes;
+    }
 
-            // FALL THROUGH!
+    return find_ascending_run_end(left, lst, cmp, std::false_type());
+}
 
-            case 0:
-            {
-                runs_left = p_queue->size();
-                offset = 0;
-                RandomIt tmp = source;
-                source = target;
-                target = tmp;
-                break;
-            }
-        }
-    }
+template<class RandomIt, class Cmp>
+RandomIt find_ascending_run_end(RandomIt left, const RandomIt lst, Cmp cmp)
+{
+    return find_ascending_run_end(left,
+                                  lst,
+                                  cmp,
+                                  typename is_simd_scannable<RandomIt,
+                                                             Cmp>::type());
 }
 
 /*******************************************************************************
-* Implements the natural merge sort, which sacrifices one pass over the input  *
-* range in order to establish an implicit queue of runs. A run is the longest  *
-* consecutive subsequence, in which all elements are ascending or strictly     *
-* descending. Every descending run is reversed to ascending run. We cannot     *
-* consider non-strictly descending runs, since that would sacrifice the stabi- *
-* lity of the algorithm. After the run queue is establish, the algorithm re-   *
-* moves two runs from the head of the queue, merges them into one run, which   *
-* is then appended to the tail of the run queue. Merging continues until the   *
-* queue contains only one run, which denotes that the entire input range is    *
-* sorted.                                                                      *
-*                                                                              *
-* The best-case complexity is O(N), the average and worst-case complexity is   *
-* O(N log N). Space complexity is O(N).                                        *
+* Returns the first 'left' in [left, lst] such that 'left == lst' or           *
+* '!cmp(*(left + 1), *left)', that is, the last element of the strictly        *
+* descending run running through 'left'.                                       *
 *******************************************************************************/
 template<class RandomIt, class Cmp>
-void natural_merge_sort(RandomIt first, RandomIt last, Cmp cmp)
+RandomIt find_descending_run_end(RandomIt left,
+                                 const RandomIt lst,
+                                 Cmp cmp,
+                                 std::false_type)
 {
-    const size_t length = std::distance(first, last);
-
-    if (length < 2)
+    while (left < lst && cmp(*(left + 1), *left))
     {
-        // Trivially sorted.
-        return;
+        ++left;
     }
 
-    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
-    RandomIt buffer = new value_type[length];
-    natural_merge_sort_impl(first, last, buffer, cmp);
-    delete[] buffer;
+    return left;
 }
 
 template<class RandomIt, class Cmp>
-struct data {
-    RandomIt source_begin;
-    RandomIt source_end;
-    RandomIt target_begin;
-    Cmp cmp;
-};
+RandomIt find_descending_run_end(RandomIt left,
+                                 const RandomIt lst,
+                                 Cmp cmp,
+                                 std::true_type)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    const std::ptrdiff_t lanes = simd_scan_lanes<value_type>::value;
+    const unsigned all_lanes = (1u << lanes) - 1;
 
-template<class RandomIt, class Cmp>
-struct data2 {
-    RandomIt target;
-    RandomIt source;
-    size_t length;
-    size_t quota;
-    Cmp cmp;
-};
+    // Most runs of random data end within a few elements, and a scalar
+    // comparison is cheaper than a vector one for those.
+    for (std::ptrdiff_t i = 0; i < SCALAR_SCAN_PREFIX; ++i)
+    {
+        if (left == lst || !cmp(*(left + 1), *left))
+        {
+            return left;
+        }
 
-template<class RandomIt, class Cmp>
-void* parallel_natural_merge_sort_thread_proxy(void*);
+        ++left;
+    }
+
+    while (lst - left >= lanes)
+    {
+        const unsigned ascents = ~simd_descents(&*left) & all_lanes;
+
+        if (ascents != 0)
+        {
+            return left + __builtin_ctz(ascents);
+        }
+
+        left += lanes;
+    }
+
+    return find_descending_run_end(left, lst, cmp, std::false_type());
+}
 
 template<class RandomIt, class Cmp>
-void* natural_merge_sort_thread_proxy(void* args) 
+RandomIt find_descending_run_end(RandomIt left, const RandomIt lst, Cmp cmp)
 {
-    data<RandomIt, Cmp>* p_data = (data<RandomIt, Cmp>*) args;
-    natural_merge_sort_impl(p_data->source_begin,
-                            p_data->source_end,
-                            p_data->target_begin,
-                            p_data->cmp);
-    return nullptr;
+    return find_descending_run_end(left,
+                                   lst,
+                                   cmp,
+                                   typename is_simd_scannable<RandomIt,
+                                                              Cmp>::type());
 }
 
-
 /*******************************************************************************
-* Implements parallel merge sort.                                              *
+* Returns the first 'left' in [left, lst] such that 'left == lst' or           *
+* 'cmp(*left, *(left + 1))', that is, the last element of the non-increasing   *
+* run running through 'left'. The vector scan finds only the strict descents,  *
+* so this one is scalar.                                                       *
 *******************************************************************************/
 template<class RandomIt, class Cmp>
-void parallel_natural_merge_sort_impl(RandomIt source, 
-                                      RandomIt target, 
-                                      const size_t length, 
-                                      const size_t thread_quota,
-                                      Cmp cmp)
+RandomIt find_non_ascending_run_end(RandomIt left,
+                                    const RandomIt lst,
+                                    Cmp cmp)
 {
-    if (thread_quota == 1)
+    while (left < lst && !cmp(*left, *(left + 1)))
     {
-        natural_merge_sort_impl(target, target + length, source, cmp);
+        ++left;
+    }
+
+    return left;
+}
+
+/*******************************************************************************
+* Scans the range [first, last) from left to right and calls                   *
+* 'handle_run(head, tail, descending)' for each run [head, tail) in the order  *
+* they appear. A run is either ascending or strictly descending. The runs are  *
+* not reversed by the scanner.                                                 *
+*******************************************************************************/
+template<class RandomIt, class Cmp, class RunHandler>
+void scan_runs(RandomIt first, RandomIt last, Cmp cmp, RunHandler& handle_run)
+{
+    RandomIt head;
+    RandomIt left = first;
+    RandomIt right = left + 1;
+
+    const RandomIt lst = last - 1;
+
+    while (left < lst)
+    {
+        head = left;
+
+        if (cmp(*right++, *left++))
+        {
+            // Reading a strictly descending run.
+            left = find_descending_run_end(left, lst, cmp);
+            right = left + 1;
+            handle_run(head, right, true);
+        }
+        else
+        {
+            // Reading a ascending run.
+            left = find_ascending_run_end(left, lst, cmp);
+            right = left + 1;
+            handle_run(head, right, false);
+        }
+
+        ++left;
+        ++right;
+    }
+
+    if (left == lst)
+    {
+        // Handle the case of an orphan element at the end of the range.
+        handle_run(left, last, false);
+    }
+}
+
+/*******************************************************************************
+* Reverses every descending run it is given and appends the run length to the  *
+* run queue.                                                                   *
+*******************************************************************************/
+template<class RandomIt, class Int>
+struct run_queue_builder {
+    UnsafeIntQueue<Int>* p_queue;
+
+    void operator()(RandomIt head, RandomIt tail, const bool descending)
+    {
+        if (descending)
+        {
+            std::reverse(head, tail);
+        }
+
+        p_queue->enqueue(tail - head);
+    }
+};
+
+/*******************************************************************************
+* Returns the end of the run starting at 'head', which must precede 'last'.    *
+* The run is scanned just like in 'scan_runs'; if it is descending, it is      *
+* reversed. If 'stable' is false, a descending run need not be strict, and a   *
+* run of equal elements followed by a descent is read as a descending run.     *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+RandomIt scan_and_orient_run(RandomIt head,
+                             RandomIt last,
+                             Cmp cmp,
+                             const bool stable)
+{
+    RandomIt tail = head + 1;
+
+    if (tail == last)
+    {
+        return tail;
+    }
+
+    if (cmp(*tail, *head))
+    {
+        // Reading a descending run.
+        tail = (stable ? find_descending_run_end(tail, last - 1, cmp) :
+                         find_non_ascending_run_end(tail, last - 1, cmp)) + 1;
+        std::reverse(head, tail);
+        return tail;
+    }
+
+    // Reading a ascending run.
+    tail = find_ascending_run_end(tail, last - 1, cmp) + 1;
+
+    if (!stable && tail != last && !cmp(*head, *(tail - 1)) &&
+        cmp(*tail, *(tail - 1)))
+    {
+        // The run is of equal elements, so it starts a descending run.
+        tail = find_non_ascending_run_end(tail, last - 1, cmp) + 1;
+        std::reverse(head, tail);
+    }
+
+    return tail;
+}
+
+/*******************************************************************************
+* Sorts the range [first, last), whose prefix [first, middle) is already       *
+* sorted, by inserting the remaining elements one by one. Each element is      *
+* shifted left past the greater elements, so equal elements keep their order.  *
+* For the short ranges this is used on, the linear search beats the binary     *
+* search, as its branches are predictable.                                     *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+void insertion_sort(RandomIt first, RandomIt middle, RandomIt last, Cmp cmp)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    for (; middle != last; ++middle)
+    {
+        if (cmp(*middle, *(middle - 1)))
+        {
+            value_type value = std::move(*middle);
+            RandomIt hole = middle;
+
+            do
+            {
+                *hole = std::move(*(hole - 1));
+                --hole;
+            }
+            while (hole != first && cmp(value, *(hole - 1)));
+
+            *hole = std::move(value);
+        }
+    }
+}
+
+/*******************************************************************************
+* Returns the end of the run starting at 'head', which must precede 'last',    *
+* after orienting it as with 'stable'. A run shorter than                      *
+* 'minimum_run_length' is extended to that length, or to 'last' if that comes  *
+* first, by insertion sort.                                                    *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+RandomIt scan_next_run(RandomIt head,
+                       RandomIt last,
+                       Cmp cmp,
+                       const size_t minimum_run_length,
+                       const bool stable)
+{
+    RandomIt tail = scan_and_orient_run(head, last, cmp, stable);
+    const size_t run_length = std::distance(head, tail);
+
+    if (run_length < minimum_run_length)
+    {
+        const RandomIt extended_tail =
+                head + std::min(minimum_run_length,
+                                (size_t) std::distance(head, last));
+
+        insertion_sort(head, tail, extended_tail, cmp);
+        tail = extended_tail;
+    }
+
+    return tail;
+}
+
+/*******************************************************************************
+* Scans the range [first, last) and appends to 'queue' the sizes of each run   *
+* in the order they appear while scanning from left to right. If               *
+* 'minimum_run_length' is greater than one, every run shorter than it, except  *
+* at the end of the range, is extended to that length by insertion sort. If    *
+* 'stable' is false, the descending runs are read as in 'scan_and_orient_run'. *
+*******************************************************************************/
+template<class RandomIt, class Cmp, class Int>
+void build_run_size_queue(RandomIt first,
+                          RandomIt last,
+                          Cmp cmp,
+                          UnsafeIntQueue<Int>& queue,
+                          const size_t minimum_run_length,
+                          const bool stable)
+{
+    if (minimum_run_length < 2 && stable)
+    {
+        run_queue_builder<RandomIt, Int> builder;
+        builder.p_queue = &queue;
+        scan_runs(first, last, cmp, builder);
+        return;
+    }
+
+    RandomIt head = first;
+
+    while (head != last)
+    {
+        const RandomIt tail = scan_next_run(head,
+                                            last,
+                                            cmp,
+                                            minimum_run_length,
+                                            stable);
+        queue.enqueue(std::distance(head, tail));
+        head = tail;
+    }
+}
+
+/*******************************************************************************
+* Returns the amount of leading zeros in 'num'.                                *
+*******************************************************************************/
+size_t leading_zeros(const size_t num)
+{
+    size_t count = 0;
+
+    for (size_t t = (size_t) 1 << (8 * sizeof(t) - 1); t; t >>= 1, ++count)
+    {
+        if ((t & num))
+        {
+            return count;
+        }
+    }
+
+    return count;
+}
+
+/*******************************************************************************
+* Returns the amount of merge passes needed to sort a range with 'run_amount'  *
+* runs.                                                                        *
+*******************************************************************************/
+size_t get_pass_amount(size_t run_amount)
+{
+    return 8 * sizeof(run_amount) - leading_zeros(run_amount - 1);
+}
+
+/*******************************************************************************
+* Returns the amount of merge passes needed to sort a range with 'run_amount'  *
+* runs when merging 'fan_in' runs at a time.                                   *
+*******************************************************************************/
+inline size_t get_pass_amount(size_t run_amount, const size_t fan_in)
+{
+    size_t passes = 0;
+
+    while (run_amount > 1)
+    {
+        run_amount = (run_amount + fan_in - 1) / fan_in;
+        ++passes;
+    }
+
+    return passes;
+}
+
+/*******************************************************************************
+* Collects the statistics of the sorts given a pointer to it in the options.   *
+* They are recorded only if 'NATURAL_MERGE_SORT_STATS' is defined before this  *
+* header is included; otherwise all the recording compiles to nothing. The     *
+* counters accumulate over the sorts, which may record concurrently, except    *
+* that one parallel sort at a time may record the times of its threads.        *
+*                                                                              *
+* The runs are recorded as they are handed to the merges, so the bounded sorts *
+* under a scratch budget, which scan them lazily, record none. The merge       *
+* passes are the passes of the 'FIFO_QUEUE' and 'LOSER_TREE' policies, each of *
+* which moves the whole range, and the moved bytes add the moves of these      *
+* passes and of the parallel merges. Counting the comparisons wraps the        *
+* comparator, which turns off the vector kernels and the radix sort, so that   *
+* the counts describe the comparison-based sort.                               *
+*******************************************************************************/
+struct NaturalMergeSortStats {
+
+    // The time a thread spent on the parallel sorts it took part in.
+    struct ThreadTimes {
+        std::thread::id thread;
+        uint64_t chunks;
+        uint64_t chunk_nanoseconds;
+        uint64_t merge_nanoseconds;
+        uint64_t sort_nanoseconds;
+        size_t last_sort;
+
+        // The time the thread neither sorted a chunk nor merged.
+        uint64_t idle_nanoseconds() const
+        {
+            const uint64_t busy = chunk_nanoseconds + merge_nanoseconds;
+            return sort_nanoseconds > busy ? sort_nanoseconds - busy : 0;
+        }
+    };
+
+    // The amount of runs, and the amount of runs of length in [2^i, 2^(i+1))
+    // for every 'i'.
+    std::atomic<uint64_t> runs;
+    std::atomic<uint64_t> run_length_histogram[RUN_LENGTH_HISTOGRAM_BUCKETS];
+
+    std::atomic<uint64_t> merge_passes;
+    std::atomic<uint64_t> bytes_moved;
+
+    // The comparisons are counted only if this is set.
+    bool count_comparisons;
+    std::atomic<uint64_t> comparisons;
+
+    std::atomic<uint64_t> parallel_sorts;
+    std::mutex threads_mutex;
+    std::vector<ThreadTimes> threads;
+
+    NaturalMergeSortStats() :
+    runs{0},
+    merge_passes{0},
+    bytes_moved{0},
+    count_comparisons{false},
+    comparisons{0},
+    parallel_sorts{0}
+    {
+        for (std::atomic<uint64_t>& bucket : run_length_histogram)
+        {
+            bucket.store(0);
+        }
+    }
+
+    NaturalMergeSortStats(const NaturalMergeSortStats&) = delete;
+    NaturalMergeSortStats& operator=(const NaturalMergeSortStats&) = delete;
+};
+
+/*******************************************************************************
+* Returns the time of the steady clock in nanoseconds if the statistics are    *
+* recorded into 'p_stats', and zero otherwise.                                 *
+*******************************************************************************/
+inline uint64_t stats_clock(const NaturalMergeSortStats* p_stats)
+{
+#ifdef NATURAL_MERGE_SORT_STATS
+    if (p_stats)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+#endif
+    (void) p_stats;
+    return 0;
+}
+
+/*******************************************************************************
+* Records the run lengths 'runs.at(0)', ..., 'runs.at(runs.size() - 1)'.       *
+*******************************************************************************/
+template<class Runs>
+void stats_record_runs(NaturalMergeSortStats* p_stats, const Runs& runs)
+{
+#ifdef NATURAL_MERGE_SORT_STATS
+    if (p_stats)
+    {
+        p_stats->runs += runs.size();
+
+        for (size_t i = 0; i != runs.size(); ++i)
+        {
+            const size_t run_length = runs.at(i);
+            ++p_stats->run_length_histogram[8 * sizeof(size_t) - 1 -
+                                            leading_zeros(run_length)];
+        }
+    }
+#endif
+    (void) p_stats;
+    (void) runs;
+}
+
+/*******************************************************************************
+* Records 'passes' merge passes, which together moved 'bytes' bytes.           *
+*******************************************************************************/
+inline void stats_record_moves(NaturalMergeSortStats* p_stats,
+                               const size_t passes,
+                               const size_t bytes)
+{
+#ifdef NATURAL_MERGE_SORT_STATS
+    if (p_stats)
+    {
+        p_stats->merge_passes += passes;
+        p_stats->bytes_moved += bytes;
+    }
+#endif
+    (void) p_stats;
+    (void) passes;
+    (void) bytes;
+}
+
+/*******************************************************************************
+* Adds the time since 'start' to the field 'field' of the times of the calling *
+* thread in the current parallel sort. A chunk counts towards 'chunks'.        *
+*******************************************************************************/
+inline void stats_record_thread_time(
+        NaturalMergeSortStats* p_stats,
+        uint64_t NaturalMergeSortStats::ThreadTimes::* field,
+        const uint64_t start)
+{
+#ifdef NATURAL_MERGE_SORT_STATS
+    if (p_stats)
+    {
+        const uint64_t elapsed = stats_clock(p_stats) - start;
+        const std::thread::id thread = std::this_thread::get_id();
+        std::lock_guard<std::mutex> lock(p_stats->threads_mutex);
+        NaturalMergeSortStats::ThreadTimes* p_times = nullptr;
+
+        for (NaturalMergeSortStats::ThreadTimes& times : p_stats->threads)
+        {
+            if (times.thread == thread)
+            {
+                p_times = &times;
+            }
+        }
+
+        if (!p_times)
+        {
+            p_stats->threads.push_back({thread, 0, 0, 0, 0, 0});
+            p_times = &p_stats->threads.back();
+        }
+
+        p_times->*field += elapsed;
+        p_times->chunks +=
+                field == &NaturalMergeSortStats::ThreadTimes::chunk_nanoseconds;
+        p_times->last_sort = p_stats->parallel_sorts;
+    }
+#endif
+    (void) p_stats;
+    (void) field;
+    (void) start;
+}
+
+/*******************************************************************************
+* Starts a parallel sort. Returns the start time to pass to                    *
+* 'stats_end_parallel_sort'.                                                   *
+*******************************************************************************/
+inline uint64_t stats_begin_parallel_sort(NaturalMergeSortStats* p_stats)
+{
+#ifdef NATURAL_MERGE_SORT_STATS
+    if (p_stats)
+    {
+        ++p_stats->parallel_sorts;
+    }
+#endif
+    return stats_clock(p_stats);
+}
+
+/*******************************************************************************
+* Ends the parallel sort started at 'start', adding its duration to the times  *
+* of all the threads that took part in it.                                     *
+*******************************************************************************/
+inline void stats_end_parallel_sort(NaturalMergeSortStats* p_stats,
+                                    const uint64_t start)
+{
+#ifdef NATURAL_MERGE_SORT_STATS
+    if (p_stats)
+    {
+        const uint64_t elapsed = stats_clock(p_stats) - start;
+        std::lock_guard<std::mutex> lock(p_stats->threads_mutex);
+
+        for (NaturalMergeSortStats::ThreadTimes& times : p_stats->threads)
+        {
+            if (times.last_sort == p_stats->parallel_sorts)
+            {
+                times.sort_nanoseconds += elapsed;
+            }
+        }
+    }
+#endif
+    (void) p_stats;
+    (void) start;
+}
+
+#ifdef NATURAL_MERGE_SORT_STATS
+/*******************************************************************************
+* Wraps a comparator counting its calls. Every copy counts on its own and adds *
+* its count to the statistics when it is destroyed, so that the copies used by *
+* different threads share no counter.                                          *
+*******************************************************************************/
+template<class Cmp>
+struct counting_comparator {
+    Cmp cmp;
+    NaturalMergeSortStats* p_stats;
+    mutable uint64_t count;
+
+    counting_comparator(Cmp cmp, NaturalMergeSortStats* p_stats) :
+    cmp(cmp),
+    p_stats{p_stats},
+    count{0}
+    {}
+
+    counting_comparator(const counting_comparator& other) :
+    cmp(other.cmp),
+    p_stats{other.p_stats},
+    count{0}
+    {}
+
+    counting_comparator& operator=(const counting_comparator& other)
+    {
+        cmp = other.cmp;
+        p_stats = other.p_stats;
+        return *this;
+    }
+
+    ~counting_comparator()
+    {
+        if (count != 0)
+        {
+            p_stats->comparisons += count;
+        }
+    }
+
+    template<class T, class U>
+    bool operator()(const T& a, const U& b) const
+    {
+        ++count;
+        return cmp(a, b);
+    }
+};
+
+template<class Cmp>
+struct is_counting_comparator : std::false_type {};
+
+template<class Cmp>
+struct is_counting_comparator<counting_comparator<Cmp>> : std::true_type {};
+
+/*******************************************************************************
+* Returns true if a sort as specified by 'options' is to count the calls of    *
+* its comparator 'Cmp', which it does not count yet.                           *
+*******************************************************************************/
+template<class Cmp>
+bool counts_comparisons(const NaturalMergeSortOptions& options)
+{
+    return !is_counting_comparator<Cmp>::value &&
+           options.p_stats &&
+           options.p_stats->count_comparisons;
+}
+
+template<class Cmp>
+counting_comparator<Cmp> make_counting_comparator(
+        Cmp cmp,
+        NaturalMergeSortStats* p_stats)
+{
+    return counting_comparator<Cmp>(cmp, p_stats);
+}
+
+template<class Cmp>
+counting_comparator<Cmp> make_counting_comparator(
+        counting_comparator<Cmp> cmp,
+        NaturalMergeSortStats*)
+{
+    return cmp;
+}
+#endif
+
+/*******************************************************************************
+* Destroys the elements in the range [first, last).                            *
+*******************************************************************************/
+template<class T>
+void destroy_range(T* first, T* last)
+{
+    for (; first != last; ++first)
+    {
+        first->~T();
+    }
+}
+
+/*******************************************************************************
+* Implements an output iterator over raw storage, which constructs the         *
+* elements it is given in place instead of assigning them to existing ones. If *
+* 'p_constructed' is not null, every element constructed is counted in it, so  *
+* that the constructed prefix of storage written in order is known when the    *
+* comparator of a merge throws.                                                *
+*******************************************************************************/
+template<class T>
+class ConstructingIterator {
+private:
+
+    T* m_p;
+    size_t* m_p_constructed;
+
+public:
+
+    typedef std::output_iterator_tag iterator_category;
+    typedef void value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef void pointer;
+    typedef void reference;
+
+    explicit ConstructingIterator(T* p, size_t* p_constructed = nullptr) :
+    m_p{p},
+    m_p_constructed{p_constructed}
+    {}
+
+    ConstructingIterator& operator*()
+    {
+        return *this;
+    }
+
+    ConstructingIterator& operator=(T&& value)
+    {
+        ::new ((void*) m_p) T(std::move(value));
+
+        if (m_p_constructed)
+        {
+            ++*m_p_constructed;
+        }
+
+        return *this;
+    }
+
+    ConstructingIterator& operator++()
+    {
+        ++m_p;
+        return *this;
+    }
+
+    ConstructingIterator operator++(int)
+    {
+        ConstructingIterator ret = *this;
+        ++m_p;
+        return ret;
+    }
+
+    ConstructingIterator operator+(const size_t offset) const
+    {
+        return ConstructingIterator(m_p + offset, m_p_constructed);
+    }
+};
+
+/*******************************************************************************
+* Returns an iterator constructing the elements into the raw storage at        *
+* 'buffer', counting them in 'p_constructed' unless it is null.                *
+*******************************************************************************/
+template<class BufferIt>
+ConstructingIterator<typename std::iterator_traits<BufferIt>::value_type>
+make_constructing_iterator(BufferIt buffer, size_t* p_constructed = nullptr)
+{
+    typedef typename std::iterator_traits<BufferIt>::value_type value_type;
+    return ConstructingIterator<value_type>(&*buffer, p_constructed);
+}
+
+/*******************************************************************************
+* Destroys the first 'constructed()' elements of the raw storage at 'buffer'   *
+* when it goes out of scope, unless it is released. A sort keeps the count of  *
+* the elements it constructed in the guard, so that they are destroyed even if *
+* its comparator throws, and releases the guard once the elements are handed   *
+* over to its caller.                                                          *
+*******************************************************************************/
+template<class BufferIt>
+class raw_storage_guard {
+private:
+
+    BufferIt m_buffer;
+    size_t m_constructed;
+
+public:
+
+    explicit raw_storage_guard(BufferIt buffer) :
+    m_buffer(buffer),
+    m_constructed{0}
+    {}
+
+    raw_storage_guard(const raw_storage_guard&) = delete;
+    raw_storage_guard& operator=(const raw_storage_guard&) = delete;
+
+    ~raw_storage_guard()
+    {
+        typedef typename std::iterator_traits<BufferIt>::value_type value_type;
+
+        if (m_constructed > 0)
+        {
+            destroy_range<value_type>(&*m_buffer, &*m_buffer + m_constructed);
+        }
+    }
+
+    size_t& constructed()
+    {
+        return m_constructed;
+    }
+
+    void release()
+    {
+        m_constructed = 0;
+    }
+};
+
+/*******************************************************************************
+* Returns the first position in the sorted range [first, last) whose element   *
+* is greater than 'value'. The search gallops from 'first' with exponentially  *
+* growing steps and then searches the last step by bisection, so that it takes *
+* O(log k) comparisons, where k is the distance of the result from 'first'.    *
+*******************************************************************************/
+template<class RandomIt, class T, class Cmp>
+RandomIt gallop_upper_bound(RandomIt first,
+                            RandomIt last,
+                            const T& value,
+                            Cmp cmp)
+{
+    const size_t length = std::distance(first, last);
+    size_t previous = 0;
+    size_t offset = 1;
+
+    while (offset <= length && !cmp(value, first[offset - 1]))
+    {
+        previous = offset;
+        offset <<= 1;
+    }
+
+    return std::upper_bound(first + previous,
+                            first + std::min(offset, length),
+                            value,
+                            cmp);
+}
+
+/*******************************************************************************
+* Returns the first position in the sorted range [first, last) whose element   *
+* is not less than 'value'. Gallops just like 'gallop_upper_bound'.            *
+*******************************************************************************/
+template<class RandomIt, class T, class Cmp>
+RandomIt gallop_lower_bound(RandomIt first,
+                            RandomIt last,
+                            const T& value,
+                            Cmp cmp)
+{
+    const size_t length = std::distance(first, last);
+    size_t previous = 0;
+    size_t offset = 1;
+
+    while (offset <= length && cmp(first[offset - 1], value))
+    {
+        previous = offset;
+        offset <<= 1;
+    }
+
+    return std::lower_bound(first + previous,
+                            first + std::min(offset, length),
+                            value,
+                            cmp);
+}
+
+/*******************************************************************************
+* Returns the amount of elements the first 'diagonal' elements of the stable   *
+* merge of the runs [first1, first1 + length1) and [first2, first2 + length2)  *
+* take from the left run. Just like in 'std::merge', ties are resolved in      *
+* favour of the left run, so cutting both runs at the co-ranked positions      *
+* and merging the pieces independently preserves the stability. Runs in        *
+* O(log min(length1, length2)) time.                                           *
+*******************************************************************************/
+template<class RandomIt1, class RandomIt2, class Cmp>
+size_t merge_path_split(RandomIt1 first1,
+                        const size_t length1,
+                        RandomIt2 first2,
+                        const size_t length2,
+                        const size_t diagonal,
+                        Cmp cmp)
+{
+    size_t lo = diagonal > length2 ? diagonal - length2 : 0;
+    size_t hi = std::min(diagonal, length1);
+
+    while (lo < hi)
+    {
+        const size_t mid = lo + (hi - lo) / 2;
+
+        if (cmp(*(first2 + (diagonal - mid - 1)), *(first1 + mid)))
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+
+    return lo;
+}
+
+/*******************************************************************************
+* Tells whether 'Cmp' is one of the standard comparators ordering the          *
+* arithmetic type 'T' by its built-in operators. Such comparisons are cheap    *
+* and free of side effects, so that the merges may evaluate them without       *
+* branching on the result.                                                     *
+*******************************************************************************/
+template<class T, class Cmp>
+struct is_branchless_comparator : std::integral_constant<bool,
+        std::is_arithmetic<T>::value &&
+        (std::is_same<Cmp, std::less<T>>::value ||
+         std::is_same<Cmp, std::greater<T>>::value)> {};
+
+#if __cplusplus >= 201402L
+template<class T>
+struct is_branchless_comparator<T, std::less<>> : std::is_arithmetic<T> {};
+
+template<class T>
+struct is_branchless_comparator<T, std::greater<>> : std::is_arithmetic<T> {};
+#endif
+
+#ifdef __AVX2__
+
+/*******************************************************************************
+* Tells whether the merges from 'InputIt1' and 'InputIt2' to 'OutputIt' with   *
+* 'Cmp' may run on the AVX2 kernels: all of them must address contiguous       *
+* 32-bit integers, which are ordered by 'std::less'. Since equal integers are  *
+* indistinguishable, the kernels need not be stable.                           *
+*******************************************************************************/
+template<class InputIt1, class InputIt2, class OutputIt, class Cmp>
+struct is_simd_mergeable
+{
+    typedef typename std::iterator_traits<InputIt1>::value_type value_type;
+
+    static constexpr bool value =
+        (std::is_same<value_type, int32_t>::value ||
+         std::is_same<value_type, uint32_t>::value) &&
+        is_contiguous_iterator<InputIt1, value_type>::value &&
+        is_contiguous_iterator<InputIt2, value_type>::value &&
+        is_contiguous_iterator<OutputIt, value_type>::value &&
+        is_standard_less<value_type, Cmp>::value;
+};
+
+inline __m256i simd_min(const __m256i a, const __m256i b, const int32_t*)
+{
+    return _mm256_min_epi32(a, b);
+}
+
+inline __m256i simd_max(const __m256i a, const __m256i b, const int32_t*)
+{
+    return _mm256_max_epi32(a, b);
+}
+
+inline __m256i simd_min(const __m256i a, const __m256i b, const uint32_t*)
+{
+    return _mm256_min_epu32(a, b);
+}
+
+inline __m256i simd_max(const __m256i a, const __m256i b, const uint32_t*)
+{
+    return _mm256_max_epu32(a, b);
+}
+
+/*******************************************************************************
+* Merges the two sorted vectors 'lo' and 'hi' of eight 32-bit integers with a  *
+* bitonic merge network. On return, 'lo' holds the eight smallest of the       *
+* sixteen integers and 'hi' the eight greatest, both in ascending order.       *
+*******************************************************************************/
+template<class T>
+inline void simd_bitonic_merge(__m256i& lo, __m256i& hi)
+{
+    const T* tag = nullptr;
+
+    // Reversing one of the sorted vectors makes the pair bitonic.
+    hi = _mm256_permutevar8x32_epi32(hi, _mm256_setr_epi32(7, 6, 5, 4,
+                                                           3, 2, 1, 0));
+    __m256i l = simd_min(lo, hi, tag);
+    __m256i h = simd_max(lo, hi, tag);
+
+    // Compare the elements 4, 2 and 1 positions apart.
+    __m256i lt = _mm256_permute2x128_si256(l, l, 1);
+    __m256i ht = _mm256_permute2x128_si256(h, h, 1);
+    l = _mm256_blend_epi32(simd_min(l, lt, tag), simd_max(l, lt, tag), 0xF0);
+    h = _mm256_blend_epi32(simd_min(h, ht, tag), simd_max(h, ht, tag), 0xF0);
+
+    lt = _mm256_shuffle_epi32(l, _MM_SHUFFLE(1, 0, 3, 2));
+    ht = _mm256_shuffle_epi32(h, _MM_SHUFFLE(1, 0, 3, 2));
+    l = _mm256_blend_epi32(simd_min(l, lt, tag), simd_max(l, lt, tag), 0xCC);
+    h = _mm256_blend_epi32(simd_min(h, ht, tag), simd_max(h, ht, tag), 0xCC);
+
+    lt = _mm256_shuffle_epi32(l, _MM_SHUFFLE(2, 3, 0, 1));
+    ht = _mm256_shuffle_epi32(h, _MM_SHUFFLE(2, 3, 0, 1));
+    lo = _mm256_blend_epi32(simd_min(l, lt, tag), simd_max(l, lt, tag), 0xAA);
+    hi = _mm256_blend_epi32(simd_min(h, ht, tag), simd_max(h, ht, tag), 0xAA);
+}
+
+/*******************************************************************************
+* Merges a prefix of the sorted arrays [first1, first1 + length1) and          *
+* [first2, first2 + length2) of 32-bit integers into 'result' eight integers   *
+* at a time, and returns the length of the merged prefix. The merge stops as   *
+* soon as the next block of eight integers is not available, and the eight     *
+* integers still held in the registers are dropped: as they are the greatest   *
+* integers loaded so far, the output is the smallest integers of both arrays,  *
+* and the caller resumes the merge at the co-ranked positions.                 *
+*******************************************************************************/
+template<class T>
+size_t simd_merge_prefix(const T* first1,
+                         const size_t length1,
+                         const T* first2,
+                         const size_t length2,
+                         T* result)
+{
+    if (length1 < 8 || length2 < 8)
+    {
+        return 0;
+    }
+
+    __m256i lo = _mm256_loadu_si256((const __m256i*) first1);
+    __m256i hi = _mm256_loadu_si256((const __m256i*) first2);
+    size_t index1 = 8;
+    size_t index2 = 8;
+    size_t merged = 0;
+
+    while (true)
+    {
+        simd_bitonic_merge<T>(lo, hi);
+        _mm256_storeu_si256((__m256i*) (result + merged), lo);
+        merged += 8;
+
+        if (index1 == length1 || index2 == length2)
+        {
+            break;
+        }
+
+        // Load the next block from the array with the smaller head.
+        if (first2[index2] < first1[index1])
+        {
+            if (index2 + 8 > length2)
+            {
+                break;
+            }
+
+            lo = _mm256_loadu_si256((const __m256i*) (first2 + index2));
+            index2 += 8;
+        }
+        else
+        {
+            if (index1 + 8 > length1)
+            {
+                break;
+            }
+
+            lo = _mm256_loadu_si256((const __m256i*) (first1 + index1));
+            index1 += 8;
+        }
+    }
+
+    return merged;
+}
+
+/*******************************************************************************
+* Runs 'simd_merge_prefix' on the storage of the iterators.                    *
+*******************************************************************************/
+template<class InputIt1, class InputIt2, class OutputIt>
+size_t simd_merge_prefix(InputIt1 first1,
+                         const size_t length1,
+                         InputIt2 first2,
+                         const size_t length2,
+                         OutputIt result,
+                         std::true_type)
+{
+    if (length1 == 0 || length2 == 0)
+    {
+        return 0;
+    }
+
+    return simd_merge_prefix(&*first1, length1, &*first2, length2, &*result);
+}
+
+/*******************************************************************************
+* Does nothing for the merges the AVX2 kernels do not apply to.                *
+*******************************************************************************/
+template<class InputIt1, class InputIt2, class OutputIt>
+size_t simd_merge_prefix(InputIt1,
+                         const size_t,
+                         InputIt2,
+                         const size_t,
+                         OutputIt,
+                         std::false_type)
+{
+    return 0;
+}
+#endif
+
+/*******************************************************************************
+* Moves the smaller one of the heads of two ranges to 'result' and advances    *
+* the iterators. 'count1' and 'count2' count how many times in a row either    *
+* range has won. Ties are resolved in favour of the first range.               *
+*******************************************************************************/
+template<class InputIt1, class InputIt2, class OutputIt, class Cmp>
+inline void merge_one(InputIt1& first1,
+                      InputIt2& first2,
+                      OutputIt& result,
+                      Cmp& cmp,
+                      size_t& count1,
+                      size_t& count2,
+                      std::false_type)
+{
+    if (cmp(*first2, *first1))
+    {
+        *result = std::move(*first2);
+        ++first2;
+        ++count2;
+        count1 = 0;
+    }
+    else
+    {
+        *result = std::move(*first1);
+        ++first1;
+        ++count1;
+        count2 = 0;
+    }
+
+    ++result;
+}
+
+/*******************************************************************************
+* Works like the above, but for the arithmetic types ordered by a standard     *
+* comparator. The head to move is selected by conditional moves instead of a   *
+* branch, so that merging random data does not stall on mispredicted branches. *
+*******************************************************************************/
+template<class InputIt1, class InputIt2, class OutputIt, class Cmp>
+inline void merge_one(InputIt1& first1,
+                      InputIt2& first2,
+                      OutputIt& result,
+                      Cmp& cmp,
+                      size_t& count1,
+                      size_t& count2,
+                      std::true_type)
+{
+    typedef typename std::iterator_traits<InputIt1>::value_type value_type;
+
+    value_type value1 = *first1;
+    value_type value2 = *first2;
+    const bool take2 = cmp(value2, value1);
+
+    *result = std::move(take2 ? value2 : value1);
+    ++result;
+    first1 += !take2;
+    first2 += take2;
+    count1 = (count1 + 1) * !take2;
+    count2 = (count2 + 1) * take2;
+}
+
+/*******************************************************************************
+* Implements the merging loop of 'gallop_merge'. If 'second_in_place' is true, *
+* the range [first2, last2) is the tail of the output, so its elements are     *
+* not moved once the first range is exhausted. If the program is compiled      *
+* with AVX2, contiguous 32-bit integers are merged by a bitonic merge network  *
+* eight at a time before the loop starts.                                      *
+*******************************************************************************/
+template<class InputIt1, class InputIt2, class OutputIt, class Cmp>
+OutputIt gallop_merge_loop(InputIt1 first1,
+                           InputIt1 last1,
+                           InputIt2 first2,
+                           InputIt2 last2,
+                           OutputIt result,
+                           Cmp cmp,
+                           const bool second_in_place)
+{
+    typedef typename std::iterator_traits<InputIt1>::value_type value_type;
+    typedef std::integral_constant<bool,
+            is_branchless_comparator<value_type, Cmp>::value> branchless;
+
+#ifdef __AVX2__
+    if (!second_in_place)
+    {
+        const size_t length1 = std::distance(first1, last1);
+        const size_t length2 = std::distance(first2, last2);
+        const size_t merged =
+            simd_merge_prefix(first1,
+                              length1,
+                              first2,
+                              length2,
+                              result,
+                              std::integral_constant<bool,
+                                is_simd_mergeable<InputIt1,
+                                                  InputIt2,
+                                                  OutputIt,
+                                                  Cmp>::value>());
+
+        if (merged > 0)
+        {
+            const size_t taken1 = merge_path_split(first1,
+                                                   length1,
+                                                   first2,
+                                                   length2,
+                                                   merged,
+                                                   cmp);
+            first1 += taken1;
+            first2 += merged - taken1;
+            result = result + merged;
+        }
+    }
+#endif
+
+    size_t min_gallop = MINIMUM_GALLOP;
+
+    while (first1 != last1 && first2 != last2)
+    {
+        size_t count1 = 0;
+        size_t count2 = 0;
+
+        // Merge one element at a time until one of the ranges keeps winning.
+        while (count1 < min_gallop && count2 < min_gallop)
+        {
+            merge_one(first1,
+                      first2,
+                      result,
+                      cmp,
+                      count1,
+                      count2,
+                      branchless());
+
+            if (first1 == last1 || first2 == last2)
+            {
+                break;
+            }
+        }
+
+        // Gallop for as long as it pays off.
+        while (first1 != last1 && first2 != last2)
+        {
+            const InputIt1 block_end1 = gallop_upper_bound(first1,
+                                                           last1,
+                                                           *first2,
+                                                           cmp);
+            count1 = std::distance(first1, block_end1);
+            result = std::move(first1, block_end1, result);
+            first1 = block_end1;
+
+            if (first1 == last1)
+            {
+                break;
+            }
+
+            const InputIt2 block_end2 = gallop_lower_bound(first2,
+                                                           last2,
+                                                           *first1,
+                                                           cmp);
+            count2 = std::distance(first2, block_end2);
+            result = std::move(first2, block_end2, result);
+            first2 = block_end2;
+
+            if (count1 < MINIMUM_GALLOP && count2 < MINIMUM_GALLOP)
+            {
+                min_gallop += 2;
+                break;
+            }
+
+            if (min_gallop > 1)
+            {
+                --min_gallop;
+            }
+        }
+    }
+
+    result = std::move(first1, last1, result);
+
+    if (second_in_place)
+    {
+        return result + std::distance(first2, last2);
+    }
+
+    return std::move(first2, last2, result);
+}
+
+/*******************************************************************************
+* Merges the sorted ranges [first1, last1) and [first2, last2) into 'result'   *
+* just like 'std::merge' does, but moves the elements instead of copying them. *
+* Returns the end of the output.                                               *
+*                                                                              *
+* If the ranges are already in order, they are moved as two blocks without     *
+* merging. Otherwise, the elements are merged one at a time until one range    *
+* wins 'min_gallop' times in a row, after which the merge gallops: it searches *
+* each range for the end of the block preceding the head of the other range    *
+* and moves the whole block at once. Just like in TimSort, 'min_gallop' drops  *
+* while galloping pays off and rises when it does not, so that interleaved     *
+* ranges are merged at the cost of the plain merge, and blocky ranges in a     *
+* logarithmic amount of comparisons per block. The arithmetic types ordered by *
+* a standard comparator are merged one at a time without branching.            *
+*******************************************************************************/
+template<class InputIt1, class InputIt2, class OutputIt, class Cmp>
+OutputIt gallop_merge(InputIt1 first1,
+                      InputIt1 last1,
+                      InputIt2 first2,
+                      InputIt2 last2,
+                      OutputIt result,
+                      Cmp cmp)
+{
+    if (first1 != last1 && first2 != last2)
+    {
+        if (!cmp(*first2, *(last1 - 1)))
+        {
+            // The left range precedes the right range.
+            result = std::move(first1, last1, result);
+            return std::move(first2, last2, result);
+        }
+
+        if (cmp(*(last2 - 1), *first1))
+        {
+            // The right range precedes the left range.
+            result = std::move(first2, last2, result);
+            return std::move(first1, last1, result);
+        }
+    }
+
+    return gallop_merge_loop(first1, last1, first2, last2, result, cmp, false);
+}
+
+/*******************************************************************************
+* Performs one merge pass from 'source' to 'target'. Every run currently in    *
+* the run queue is dequeued. The runs are merged pairwise, and the merged runs *
+* are appended to the tail of the queue. If the amount of runs is odd, the     *
+* last run is moved as is. The elements are moved, never copied. The runs are  *
+* merged with 'gallop_merge'.                                                  *
+*******************************************************************************/
+template<class InputIt, class OutputIt, class Int, class Cmp>
+void natural_merge_pass(InputIt source,
+                        OutputIt target,
+                        UnsafeIntQueue<Int>* p_queue,
+                        Cmp cmp)
+{
+    size_t runs_left = p_queue->size();
+    size_t offset = 0;
+
+    while (runs_left > 1)
+    {
+        // Remove two runs from the head of the run queue.
+        const size_t left_run_length = p_queue->dequeue();
+        const size_t right_run_length = p_queue->dequeue();
+
+        gallop_merge(source + offset,
+                     source + offset + left_run_length,
+                     source + offset + left_run_length,
+                     source + offset + left_run_length + right_run_length,
+                     target + offset,
+                     cmp);
+
+        // Append the merged run to the tail of the queue.
+        p_queue->enqueue(left_run_length + right_run_length);
+        runs_left -= 2;
+        offset += left_run_length + right_run_length;
+    }
+
+    if (runs_left == 1)
+    {
+        const size_t single_length = p_queue->dequeue();
+
+        std::move(source + offset,
+                  source + offset + single_length,
+                  target + offset);
+
+        p_queue->enqueue(single_length);
+    }
+}
+
+/*******************************************************************************
+* Tells whether the head of the run 'a' is output before the head of the run   *
+* 'b'. Equal heads are output in the order of the runs, which keeps the merge  *
+* stable. This overload compares once.                                         *
+*******************************************************************************/
+template<class InputIt, class Cmp>
+inline bool loser_tree_beats(const InputIt* heads,
+                             const size_t a,
+                             const size_t b,
+                             Cmp& cmp,
+                             std::false_type)
+{
+    return a < b ? !cmp(*heads[b], *heads[a]) : cmp(*heads[a], *heads[b]);
+}
+
+/*******************************************************************************
+* Tells whether the head of the run 'a' is output before the head of the run   *
+* 'b', as above. This overload compares both ways so that no branch depends on *
+* the comparisons, which pays off when they are cheap.                         *
+*******************************************************************************/
+template<class InputIt, class Cmp>
+inline bool loser_tree_beats(const InputIt* heads,
+                             const size_t a,
+                             const size_t b,
+                             Cmp& cmp,
+                             std::true_type)
+{
+    const bool a_less = cmp(*heads[a], *heads[b]);
+    const bool b_less = cmp(*heads[b], *heads[a]);
+
+    return a_less | (!b_less & (a < b));
+}
+
+/*******************************************************************************
+* Merges the 'k' runs [heads[i], tails[i]) to 'target' with a tree of losers.  *
+* The leaves 'k', ..., '2k - 1' of the tree are the runs. Every inner node 'n' *
+* holds the run that lost the match between the winners of its children '2n'   *
+* and '2n + 1', so that after the winner is output, only the matches on the    *
+* path from its leaf to the root are played again, each with a single          *
+* comparison. When a run is exhausted, it is removed and the tree is built     *
+* again over the remaining runs, so that the matches need not check for        *
+* exhausted runs. The last two runs are merged with 'gallop_merge'. 'tree'     *
+* must hold at least '3k' integers, the last '2k' of which are used for the    *
+* winners while the tree is built.                                             *
+*******************************************************************************/
+template<class InputIt, class OutputIt, class Cmp>
+void loser_tree_merge(InputIt* heads,
+                      InputIt* tails,
+                      size_t k,
+                      size_t* tree,
+                      OutputIt target,
+                      Cmp cmp)
+{
+    typedef typename std::iterator_traits<InputIt>::value_type value_type;
+    typedef std::integral_constant<bool,
+            is_branchless_comparator<value_type, Cmp>::value> branchless;
+
+    while (k > 2)
+    {
+        // Play the initial tournament bottom-up.
+        size_t* const winners = tree + k;
+
+        for (size_t i = 0; i != k; ++i)
+        {
+            winners[k + i] = i;
+        }
+
+        for (size_t n = k - 1; n != 0; --n)
+        {
+            const size_t left = winners[2 * n];
+            const size_t right = winners[2 * n + 1];
+            const bool left_wins =
+                    loser_tree_beats(heads, left, right, cmp, branchless());
+
+            tree[n] = left_wins ? right : left;
+            winners[n] = left_wins ? left : right;
+        }
+
+        size_t winner = winners[1];
+
+        while (true)
+        {
+            *target = std::move(*heads[winner]);
+            ++target;
+
+            if (++heads[winner] == tails[winner])
+            {
+                break;
+            }
+
+            // Swap with masks instead of branching, as the outcomes of the
+            // matches are hard to predict.
+            for (size_t n = (k + winner) / 2; n != 0; n /= 2)
+            {
+                const size_t loser = tree[n];
+                const size_t mask = 0 - (size_t) loser_tree_beats(heads,
+                                                                  loser,
+                                                                  winner,
+                                                                  cmp,
+                                                                  branchless());
+                const size_t swap = (loser ^ winner) & mask;
+
+                tree[n] = loser ^ swap;
+                winner ^= swap;
+            }
+        }
+
+        // Remove the exhausted run, keeping the order of the others.
+        std::copy(heads + winner + 1, heads + k, heads + winner);
+        std::copy(tails + winner + 1, tails + k, tails + winner);
+        --k;
+    }
+
+    gallop_merge(heads[0], tails[0], heads[1], tails[1], target, cmp);
+}
+
+/*******************************************************************************
+* Performs one merge pass from 'source' to 'target' like 'natural_merge_pass', *
+* but merges up to 'fan_in' runs at a time with 'loser_tree_merge'. A pair of  *
+* runs is merged with 'gallop_merge' instead.                                  *
+*******************************************************************************/
+template<class InputIt, class OutputIt, class Int, class Cmp>
+void loser_tree_merge_pass(InputIt source,
+                           OutputIt target,
+                           UnsafeIntQueue<Int>* p_queue,
+                           Cmp cmp,
+                           const size_t fan_in)
+{
+    std::vector<InputIt> heads(fan_in);
+    std::vector<InputIt> tails(fan_in);
+    std::vector<size_t> tree(3 * fan_in);
+
+    size_t runs_left = p_queue->size();
+    size_t offset = 0;
+
+    while (runs_left > 0)
+    {
+        const size_t k = std::min(fan_in, runs_left);
+        size_t end = offset;
+
+        for (size_t i = 0; i != k; ++i)
+        {
+            heads[i] = source + end;
+            end += p_queue->dequeue();
+            tails[i] = source + end;
+        }
+
+        if (k == 1)
+        {
+            std::move(source + offset, source + end, target + offset);
+        }
+        else if (k == 2)
+        {
+            gallop_merge(heads[0],
+                         tails[0],
+                         heads[1],
+                         tails[1],
+                         target + offset,
+                         cmp);
+        }
+        else
+        {
+            loser_tree_merge(heads.data(),
+                             tails.data(),
+                             k,
+                             tree.data(),
+                             target + offset,
+                             cmp);
+        }
+
+        p_queue->enqueue(end - offset);
+        runs_left -= k;
+        offset = end;
+    }
+}
+
+/*******************************************************************************
+* Performs one merge pass from 'source' to 'target', merging 'fan_in' runs at  *
+* a time.                                                                      *
+*******************************************************************************/
+template<class InputIt, class OutputIt, class Int, class Cmp>
+void merge_pass(InputIt source,
+                OutputIt target,
+                UnsafeIntQueue<Int>* p_queue,
+                Cmp cmp,
+                const size_t fan_in)
+{
+    if (fan_in > 2)
+    {
+        loser_tree_merge_pass(source, target, p_queue, cmp, fan_in);
+    }
+    else
+    {
+        natural_merge_pass(source, target, p_queue, cmp);
+    }
+}
+
+/*******************************************************************************
+* Checks the cancellation flag of a sort and reports its progress, as given    *
+* by its options, counting 'total' units of work. Safe to share among the      *
+* threads of a parallel sort once the total is set.                            *
+*******************************************************************************/
+class sort_monitor {
+private:
+
+    const std::atomic<bool>* m_p_cancel;
+    std::atomic<bool>* m_p_stopped;
+    const NaturalMergeSortProgress* m_p_progress;
+    std::mutex m_mutex;
+    size_t m_done;
+    size_t m_total;
+
+public:
+
+    sort_monitor(const NaturalMergeSortOptions& options, const size_t total) :
+    m_p_cancel{options.p_cancel},
+    m_p_stopped{options.p_stopped},
+    m_p_progress{options.p_progress},
+    m_done{0},
+    m_total{total}
+    {}
+
+    sort_monitor(const sort_monitor&) = delete;
+    sort_monitor& operator=(const sort_monitor&) = delete;
+
+    /***************************************************************************
+    * Sets the total amount of units of work before any of them is done.       *
+    ***************************************************************************/
+    void set_total(const size_t total)
+    {
+        m_total = total;
+    }
+
+    /***************************************************************************
+    * Tells whether the sort is to stop. Is called only where there is work    *
+    * left, which the caller leaves undone if this returns true, so the sort   *
+    * is then recorded as stopped early.                                       *
+    ***************************************************************************/
+    bool cancelled() const
+    {
+        if (!m_p_cancel || !m_p_cancel->load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+
+        if (m_p_stopped)
+        {
+            m_p_stopped->store(true, std::memory_order_relaxed);
+        }
+
+        return true;
+    }
+
+    /***************************************************************************
+    * Counts a unit of work as done and reports the progress.                  *
+    ***************************************************************************/
+    void advance()
+    {
+        if (m_p_progress && *m_p_progress)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            (*m_p_progress)(++m_done, m_total);
+        }
+    }
+};
+
+/*******************************************************************************
+* Merges the runs of the range [first, last), whose lengths are stored in the  *
+* run queue pointed to by 'p_queue' in the order they appear in the range,     *
+* until the range is sorted, merging 'fan_in' runs at a time. 'buffer' must    *
+* point to at least as many elements as there are in the range. The buffer may *
+* be of a different iterator type than the range.                              *
+*                                                                              *
+* If 'buffer_is_raw' is true, the buffer is uninitialized storage, and the     *
+* elements are constructed into it when it is written to for the first time.   *
+* Since every merge pass writes the entire range, the buffer is then fully     *
+* constructed. Returns true if the elements of a raw buffer were constructed   *
+* and must be destroyed by the caller. If the comparator throws, the elements  *
+* constructed so far are destroyed, and the buffer is left raw.                *
+*                                                                              *
+* If 'p_monitor' is not null, every pass is reported to it, and the merging    *
+* stops once it is cancelled, after moving the data back to the range.         *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Int, class Cmp>
+bool natural_merge_runs(RandomIt first,
+                        RandomIt last,
+                        BufferIt buffer,
+                        UnsafeIntQueue<Int>* p_queue,
+                        Cmp cmp,
+                        const bool buffer_is_raw,
+                        const size_t fan_in,
+                        sort_monitor* p_monitor)
+{
+    if (p_queue->size() > 1 && p_monitor && p_monitor->cancelled())
+    {
+        return false;
+    }
+
+    // Count the amount of merge passes over the array required to bring order.
+    const size_t merge_passes = get_pass_amount(p_queue->size(), fan_in);
+
+    bool data_in_buffer = false;
+    bool buffer_constructed = !buffer_is_raw;
+    raw_storage_guard<BufferIt> guard(buffer);
+
+    // Make sure that after the last merge pass, all data ends up in the input
+    // container.
+    if ((merge_passes & 1) == 1)
+    {
+        if (buffer_constructed)
+        {
+            std::move(first, last, buffer);
+        }
+        else
+        {
+            std::move(first,
+                      last,
+                      make_constructing_iterator(buffer, &guard.constructed()));
+            buffer_constructed = true;
+        }
+
+        data_in_buffer = true;
+    }
+
+    // While there is runs to merge, do...
+    while (p_queue->size() > 1)
+    {
+        if (p_monitor && p_monitor->cancelled())
+        {
+            if (data_in_buffer)
+            {
+                std::move(buffer, buffer + std::distance(first, last), first);
+            }
+
+            break;
+        }
+
+        if (data_in_buffer)
+        {
+            merge_pass(buffer, first, p_queue, cmp, fan_in);
+        }
+        else if (buffer_constructed)
+        {
+            merge_pass(first, buffer, p_queue, cmp, fan_in);
+        }
+        else
+        {
+            // A pass writes the buffer in order, so the elements counted
+            // are the constructed ones even if a merge throws.
+            merge_pass(first,
+                       make_constructing_iterator(buffer, &guard.constructed()),
+                       p_queue,
+                       cmp,
+                       fan_in);
+            buffer_constructed = true;
+        }
+
+        data_in_buffer = !data_in_buffer;
+
+        if (p_monitor)
+        {
+            p_monitor->advance();
+        }
+    }
+
+    guard.release();
+    return buffer_is_raw && buffer_constructed;
+}
+
+/*******************************************************************************
+* Merges the runs of the range starting at 'first', whose lengths are stored   *
+* in the run queue pointed to by 'p_queue', within blocks of consecutive runs  *
+* spanning at most 'block_length' elements each, so that the block and its     *
+* slice of 'buffer' stay in the cache while its runs are merged into one. A    *
+* run longer than a block is a block of its own. Leaves the lengths of the     *
+* blocks in the queue and returns the amount of bytes the merges moved. The    *
+* buffer must not be raw. Once 'monitor' is cancelled, the runs of the         *
+* remaining blocks are left unmerged.                                          *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Int, class Cmp>
+size_t merge_runs_in_blocks(RandomIt first,
+                            BufferIt buffer,
+                            UnsafeIntQueue<Int>* p_queue,
+                            Cmp cmp,
+                            const size_t fan_in,
+                            const size_t block_length,
+                            const sort_monitor& monitor)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    UnsafeIntQueue<Int> block_queue;
+    size_t runs_left = p_queue->size();
+    size_t offset = 0;
+    size_t bytes = 0;
+
+    while (runs_left > 0)
+    {
+        size_t length = p_queue->dequeue();
+        block_queue.enqueue(length);
+        --runs_left;
+
+        while (runs_left > 0 && length + p_queue->at(0) <= block_length)
+        {
+            const size_t run_length = p_queue->dequeue();
+            block_queue.enqueue(run_length);
+            length += run_length;
+            --runs_left;
+        }
+
+        if (block_queue.size() > 1 && !monitor.cancelled())
+        {
+            const size_t passes = get_pass_amount(block_queue.size(), fan_in);
+
+            natural_merge_runs(first + offset,
+                               first + offset + length,
+                               buffer + offset,
+                               &block_queue,
+                               cmp,
+                               false,
+                               fan_in,
+                               nullptr);
+            bytes += (passes + (passes & 1)) * length * sizeof(value_type);
+            block_queue.dequeue();
+            p_queue->enqueue(length);
+        }
+        else
+        {
+            // Put the runs back as they are.
+            while (block_queue.size() > 0)
+            {
+                p_queue->enqueue(block_queue.dequeue());
+            }
+        }
+
+        offset += length;
+    }
+
+    return bytes;
+}
+
+/*******************************************************************************
+* Orders the elements in the reverse order of 'cmp'.                           *
+*******************************************************************************/
+template<class Cmp>
+struct reversed_order {
+    Cmp cmp;
+
+    explicit reversed_order(Cmp cmp) : cmp(cmp) {}
+
+    template<class T1, class T2>
+    bool operator()(const T1& a, const T2& b)
+    {
+        return cmp(b, a);
+    }
+};
+
+/*******************************************************************************
+* Moves the range [first, last) to the beginning of 'buffer'. If               *
+* 'buffer_is_raw' is true, the buffer is uninitialized storage whose first     *
+* 'constructed' elements are constructed; the elements beyond them are         *
+* constructed, and 'constructed' is updated.                                   *
+*******************************************************************************/
+template<class RandomIt, class BufferIt>
+void move_to_buffer(RandomIt first,
+                    RandomIt last,
+                    BufferIt buffer,
+                    const bool buffer_is_raw,
+                    size_t& constructed)
+{
+    const size_t length = std::distance(first, last);
+
+    if (!buffer_is_raw || length <= constructed)
+    {
+        std::move(first, last, buffer);
+        return;
+    }
+
+    std::move(first, first + constructed, buffer);
+    std::move(first + constructed,
+              last,
+              make_constructing_iterator(buffer + constructed));
+    constructed = length;
+}
+
+/*******************************************************************************
+* Merges the adjacent sorted ranges [first, middle) and [middle, last) in      *
+* place, using 'buffer' as the scratch space for the shorter one of them. The  *
+* elements at both ends that are already in place are skipped first.           *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+void merge_adjacent_runs(RandomIt first,
+                         RandomIt middle,
+                         RandomIt last,
+                         BufferIt buffer,
+                         Cmp cmp,
+                         const bool buffer_is_raw,
+                         size_t& constructed)
+{
+    if (!cmp(*middle, *(middle - 1)))
+    {
+        // Already in order.
+        return;
+    }
+
+    first = gallop_upper_bound(first, middle, *middle, cmp);
+    last = gallop_lower_bound(middle, last, *(middle - 1), cmp);
+
+    const size_t left_length = std::distance(first, middle);
+    const size_t right_length = std::distance(middle, last);
+
+    if (left_length <= right_length)
+    {
+        // Merge from the left to the right.
+        move_to_buffer(first, middle, buffer, buffer_is_raw, constructed);
+        gallop_merge_loop(buffer,
+                          buffer + left_length,
+                          middle,
+                          last,
+                          first,
+                          cmp,
+                          true);
+    }
+    else
+    {
+        // Merge from the right to the left.
+        typedef std::reverse_iterator<RandomIt> reverse_it;
+        typedef std::reverse_iterator<BufferIt> reverse_buffer_it;
+
+        move_to_buffer(middle, last, buffer, buffer_is_raw, constructed);
+
+        reversed_order<Cmp> reversed_cmp(cmp);
+
+        gallop_merge_loop(reverse_buffer_it(buffer + right_length),
+                          reverse_buffer_it(buffer),
+                          reverse_it(middle),
+                          reverse_it(first),
+                          reverse_it(last),
+                          reversed_cmp,
+                          true);
+    }
+}
+
+/*******************************************************************************
+* Works like 'merge_adjacent_runs', but uses at most 'buffer_size' elements of *
+* 'buffer'. While the shorter range does not fit in the buffer, the longer     *
+* range is split at its middle, the shorter one at the corresponding bound,    *
+* and the two inner pieces are swapped by rotation, which leaves two smaller   *
+* independent merges. The ties are broken as in the merges, so the result is   *
+* stable.                                                                      *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+void merge_adjacent_runs_bounded(RandomIt first,
+                                 RandomIt middle,
+                                 RandomIt last,
+                                 BufferIt buffer,
+                                 const size_t buffer_size,
+                                 Cmp cmp,
+                                 const bool buffer_is_raw,
+                                 size_t& constructed)
+{
+    while (first != middle && middle != last && cmp(*middle, *(middle - 1)))
+    {
+        const size_t left_length = std::distance(first, middle);
+        const size_t right_length = std::distance(middle, last);
+
+        if (std::min(left_length, right_length) <= buffer_size)
+        {
+            merge_adjacent_runs(first,
+                                middle,
+                                last,
+                                buffer,
+                                cmp,
+                                buffer_is_raw,
+                                constructed);
+            return;
+        }
+
+        RandomIt left_cut;
+        RandomIt right_cut;
+
+        if (left_length >= right_length)
+        {
+            left_cut = first + left_length / 2;
+            right_cut = std::lower_bound(middle, last, *left_cut, cmp);
+        }
+        else
+        {
+            right_cut = middle + right_length / 2;
+            left_cut = std::upper_bound(first, middle, *right_cut, cmp);
+        }
+
+        const RandomIt new_middle = std::rotate(left_cut, middle, right_cut);
+
+        // Recurse into the shorter half and loop on the longer one.
+        if (std::distance(first, new_middle) <=
+            std::distance(new_middle, last))
+        {
+            merge_adjacent_runs_bounded(first,
+                                        left_cut,
+                                        new_middle,
+                                        buffer,
+                                        buffer_size,
+                                        cmp,
+                                        buffer_is_raw,
+                                        constructed);
+            first = new_middle;
+            middle = right_cut;
+        }
+        else
+        {
+            merge_adjacent_runs_bounded(new_middle,
+                                        right_cut,
+                                        last,
+                                        buffer,
+                                        buffer_size,
+                                        cmp,
+                                        buffer_is_raw,
+                                        constructed);
+            middle = left_cut;
+            last = new_middle;
+        }
+    }
+}
+
+/*******************************************************************************
+* Returns the power of the boundary between the adjacent runs, which start at  *
+* the offset 'begin' and are 'length1' and 'length2' elements long, in a range *
+* of 'length' elements. The power is the depth of the boundary in the binary   *
+* tree of the range halved over and over: the first bit, in which the          *
+* relative positions of the midpoints of the two runs differ.                  *
+*******************************************************************************/
+inline size_t powersort_node_power(const size_t begin,
+                                   const size_t length1,
+                                   const size_t length2,
+                                   const size_t length)
+{
+    // The midpoints of the two runs, doubled to keep them integral.
+    size_t a = 2 * begin + length1;
+    size_t b = a + length1 + length2;
+    size_t power = 0;
+
+    while (true)
+    {
+        ++power;
+
+        if (a >= length)
+        {
+            a -= length;
+            b -= length;
+        }
+        else if (b >= length)
+        {
+            return power;
+        }
+
+        a <<= 1;
+        b <<= 1;
+    }
+}
+
+/*******************************************************************************
+* Holds a run on the Powersort stack along with the power of its boundary with *
+* the run after it.                                                            *
+*******************************************************************************/
+struct powersort_run {
+    size_t begin;
+    size_t length;
+    size_t power;
+};
+
+/*******************************************************************************
+* Works like 'natural_merge_runs', but merges the runs in the order of         *
+* Powersort, using at most 'buffer_size' elements of 'buffer'. The runs are    *
+* taken from 'p_queue', which may also be a 'lazy_run_queue'. The buffer       *
+* elements constructed by this function are destroyed before it returns, also  *
+* when the comparator throws, so it always returns false.                      *
+*                                                                              *
+* If 'p_monitor' is not null, every merge of two runs is reported to it, and   *
+* the merging stops once it is cancelled. The merges are done in place, so the *
+* range then holds all its elements.                                           *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class RunQueue, class Cmp>
+bool powersort_merge_runs(RandomIt first,
+                          RandomIt last,
+                          BufferIt buffer,
+                          const size_t buffer_size,
+                          RunQueue* p_queue,
+                          Cmp cmp,
+                          const bool buffer_is_raw,
+                          sort_monitor* p_monitor)
+{
+    const size_t length = std::distance(first, last);
+    std::vector<powersort_run> stack;
+    raw_storage_guard<BufferIt> guard(buffer);
+
+    size_t run_begin = 0;
+    size_t run_length = p_queue->dequeue();
+
+    // Merges the run on top of the stack with the current run. Returns false
+    // if the sort is cancelled instead.
+    auto merge_top = [&]()
+    {
+        if (p_monitor && p_monitor->cancelled())
+        {
+            return false;
+        }
+
+        const powersort_run top = stack.back();
+        stack.pop_back();
+
+        merge_adjacent_runs_bounded(first + top.begin,
+                                    first + run_begin,
+                                    first + run_begin + run_length,
+                                    buffer,
+                                    buffer_size,
+                                    cmp,
+                                    buffer_is_raw,
+                                    guard.constructed());
+
+        run_begin = top.begin;
+        run_length += top.length;
+
+        if (p_monitor)
+        {
+            p_monitor->advance();
+        }
+
+        return true;
+    };
+
+    bool merging = true;
+
+    while (merging && p_queue->size() > 0)
+    {
+        const size_t next_run_length = p_queue->dequeue();
+        const size_t power = powersort_node_power(run_begin,
+                                                  run_length,
+                                                  next_run_length,
+                                                  length);
+
+        // Merge the runs whose boundaries are deeper than the current one.
+        while (merging && !stack.empty() && stack.back().power > power)
+        {
+            merging = merge_top();
+        }
+
+        powersort_run run;
+        run.begin = run_begin;
+        run.length = run_length;
+        run.power = power;
+        stack.push_back(run);
+
+        run_begin += run_length;
+        run_length = next_run_length;
+    }
+
+    while (merging && !stack.empty())
+    {
+        merging = merge_top();
+    }
+
+    return false;
+}
+
+/*******************************************************************************
+* Merges the runs of the range [first, last), whose lengths are stored in the  *
+* run queue pointed to by 'p_queue', in the order given by the merge policy    *
+* of 'options'. Returns true if the elements of a raw buffer were constructed  *
+* and must be destroyed by the caller.                                         *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Int, class Cmp>
+bool merge_runs(RandomIt first,
+                RandomIt last,
+                BufferIt buffer,
+                UnsafeIntQueue<Int>* p_queue,
+                Cmp cmp,
+                const bool buffer_is_raw,
+                const NaturalMergeSortOptions& options)
+{
+    if (options.merge_policy == RunMergePolicy::POWERSORT)
+    {
+        // Every merge of two runs is a unit of work.
+        sort_monitor monitor(options, p_queue->size() - 1);
+
+        return powersort_merge_runs(first,
+                                    last,
+                                    buffer,
+                                    std::distance(first, last),
+                                    p_queue,
+                                    cmp,
+                                    buffer_is_raw,
+                                    &monitor);
+    }
+
+    const size_t fan_in =
+            options.merge_policy == RunMergePolicy::LOSER_TREE ?
+            std::max(options.merge_fan_in, (size_t) 2) : 2;
+
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    const size_t length = std::distance(first, last);
+    const size_t block_length = options.merge_block_bytes / sizeof(value_type);
+    const bool blocked = !buffer_is_raw && block_length > 1 &&
+                         length > block_length && p_queue->size() > 1;
+
+    sort_monitor monitor(options, 0);
+
+    if (blocked)
+    {
+        // The merges within the blocks sweep the range once.
+        stats_record_moves(options.p_stats,
+                           1,
+                           merge_runs_in_blocks(first,
+                                                buffer,
+                                                p_queue,
+                                                cmp,
+                                                fan_in,
+                                                block_length,
+                                                monitor));
+    }
+
+    const size_t passes = get_pass_amount(p_queue->size(), fan_in);
+    monitor.set_total(passes + (blocked ? 1 : 0));
+
+    if (blocked)
+    {
+        monitor.advance();
+    }
+
+    // An odd amount of passes moves the range to the buffer first.
+    stats_record_moves(options.p_stats,
+                       passes,
+                       (passes + (passes & 1)) * length * sizeof(value_type));
+
+    return natural_merge_runs(first,
+                              last,
+                              buffer,
+                              p_queue,
+                              cmp,
+                              buffer_is_raw,
+                              fan_in,
+                              &monitor);
+}
+
+/*******************************************************************************
+* Scans the runs of a range one at a time as they are dequeued, so that the    *
+* runs need not be stored. Each run is oriented, and extended to the minimum   *
+* run length, when it is scanned. Offers the part of the interface of          *
+* 'UnsafeIntQueue' that 'powersort_merge_runs' uses.                           *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+class lazy_run_queue {
+private:
+
+    RandomIt m_head;
+    RandomIt m_last;
+    Cmp m_cmp;
+    size_t m_minimum_run_length;
+    bool m_stable;
+
+public:
+
+    lazy_run_queue(RandomIt first,
+                   RandomIt last,
+                   Cmp cmp,
+                   const size_t minimum_run_length,
+                   const bool stable) :
+    m_head{first},
+    m_last{last},
+    m_cmp(cmp),
+    m_minimum_run_length{minimum_run_length},
+    m_stable{stable}
+    {}
+
+    /***************************************************************************
+    * Scans the next run and returns its length.                               *
+    ***************************************************************************/
+    size_t dequeue()
+    {
+        const RandomIt tail = scan_next_run(m_head,
+                                            m_last,
+                                            m_cmp,
+                                            m_minimum_run_length,
+                                            m_stable);
+        const size_t length = std::distance(m_head, tail);
+        m_head = tail;
+        return length;
+    }
+
+    /***************************************************************************
+    * Returns 1 if there are runs left to scan, and 0 otherwise: the amount of *
+    * the runs is not known before they are scanned.                           *
+    ***************************************************************************/
+    size_t size() const
+    {
+        return m_head != m_last ? 1 : 0;
+    }
+};
+
+/*******************************************************************************
+* Sorts the range [first, last) using at most 'buffer_size' elements of        *
+* 'buffer' in addition to the stack, which holds a logarithmic amount of runs. *
+* The runs are scanned lazily and merged in place in the order of Powersort.   *
+* If 'buffer_is_raw' is true, the buffer is uninitialized storage; its         *
+* elements constructed by this function are destroyed before it returns, also  *
+* when the comparator throws.                                                  *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+void bounded_natural_merge_sort(RandomIt first,
+                                RandomIt last,
+                                BufferIt buffer,
+                                const size_t buffer_size,
+                                Cmp cmp,
+                                const bool buffer_is_raw,
+                                const NaturalMergeSortOptions& options)
+{
+    if (std::distance(first, last) < 2)
+    {
+        // Trivially sorted.
+        return;
+    }
+
+    lazy_run_queue<RandomIt, Cmp> queue(first,
+                                        last,
+                                        cmp,
+                                        options.minimum_run_length,
+                                        options.stable);
+    powersort_merge_runs(first,
+                         last,
+                         buffer,
+                         buffer_size,
+                         &queue,
+                         cmp,
+                         buffer_is_raw,
+                         nullptr);
+}
+
+/*******************************************************************************
+* Applies the key projection 'proj' to 'value'. Since C++17, the projection    *
+* may also be a pointer to a data member or to a member function.              *
+*******************************************************************************/
+#if __cplusplus >= 201703L
+template<class Proj, class T>
+auto invoke_projection(const Proj& proj, const T& value)
+        -> decltype(std::invoke(proj, value))
+{
+    return std::invoke(proj, value);
+}
+#else
+template<class Proj, class T>
+auto invoke_projection(const Proj& proj, const T& value)
+        -> decltype(proj(value))
+{
+    return proj(value);
+}
+#endif
+
+/*******************************************************************************
+* The type of the keys 'proj' projects the 'T's to.                            *
+*******************************************************************************/
+template<class Proj, class T>
+struct projected_key {
+    typedef typename std::decay<decltype(
+            invoke_projection(std::declval<const Proj&>(),
+                              std::declval<const T&>()))>::type type;
+};
+
+/*******************************************************************************
+* Orders the elements by comparing their keys, which are obtained by applying  *
+* the projection 'proj' to them, with 'key_cmp'. The sorts recognize this      *
+* comparator, and sort the ranges with integer keys ordered by 'std::less'     *
+* with the radix sort instead of merging when that takes fewer passes.         *
+*******************************************************************************/
+template<class Proj, class KeyCmp>
+struct projected_comparator {
+    Proj proj;
+    KeyCmp key_cmp;
+
+    projected_comparator(Proj proj, KeyCmp key_cmp) :
+    proj(proj),
+    key_cmp(key_cmp)
+    {}
+
+    template<class T>
+    bool operator()(const T& a, const T& b) const
+    {
+        return key_cmp(invoke_projection(proj, a), invoke_projection(proj, b));
+    }
+};
+
+/*******************************************************************************
+* Returns the comparator ordering the elements by 'key_cmp' on their keys      *
+* projected by 'proj'.                                                         *
+*******************************************************************************/
+template<class Proj, class KeyCmp>
+projected_comparator<Proj, KeyCmp> make_projected_comparator(Proj proj,
+                                                             KeyCmp key_cmp)
+{
+    return projected_comparator<Proj, KeyCmp>(proj, key_cmp);
+}
+
+/*******************************************************************************
+* Tells whether the 'T's ordered by 'Cmp' may be sorted by the radix sort:     *
+* 'Cmp' must be a 'projected_comparator' ordering integer keys by 'std::less'. *
+*******************************************************************************/
+template<class T, class Cmp>
+struct is_radix_sortable : std::false_type {};
+
+template<class T, class Proj, class KeyCmp>
+struct is_radix_sortable<T, projected_comparator<Proj, KeyCmp>> :
+        std::integral_constant<bool,
+            std::is_integral<typename projected_key<Proj, T>::type>::value &&
+            !std::is_same<typename projected_key<Proj, T>::type, bool>::value &&
+            is_standard_less<typename projected_key<Proj, T>::type,
+                             KeyCmp>::value> {};
+
+/*******************************************************************************
+* Maps the integer 'key' to an unsigned integer of the same width, such that   *
+* the unsigned integers are in the same order as the keys.                     *
+*******************************************************************************/
+template<class Key>
+typename std::make_unsigned<Key>::type radix_order(const Key key)
+{
+    typedef typename std::make_unsigned<Key>::type unsigned_key;
+    const unsigned_key sign_bit =
+            std::is_signed<Key>::value ?
+                (unsigned_key) 1 << (8 * sizeof(Key) - 1) : 0;
+    return (unsigned_key) key ^ sign_bit;
+}
+
+/*******************************************************************************
+* Moves the 'length' elements starting at 'source' to 'target', placing each   *
+* element after the elements whose radix digit at 'shift' is smaller and after *
+* the preceding elements with the same digit. 'offsets[d]' is the position of  *
+* the next element with digit 'd' in 'target'.                                 *
+*******************************************************************************/
+template<class InputIt, class OutputIt, class Proj>
+void radix_scatter(InputIt source,
+                   const size_t length,
+                   OutputIt target,
+                   const Proj& proj,
+                   const size_t shift,
+                   size_t* offsets)
+{
+    for (size_t i = 0; i != length; ++i, ++source)
+    {
+        const size_t digit =
+            (radix_order(invoke_projection(proj, *source)) >> shift) & 0xFF;
+        *(target + offsets[digit]++) = std::move(*source);
+    }
+}
+
+/*******************************************************************************
+* Returns the amount of radix sort passes needed to sort the range             *
+* [first, last) by the integer keys 'proj' projects its elements to, which is  *
+* the amount of bytes that are not equal in all the keys. This only reads the  *
+* keys, so it is cheaper than counting their digits.                           *
+*******************************************************************************/
+template<class RandomIt, class Proj>
+size_t count_radix_passes(RandomIt first, RandomIt last, const Proj& proj)
+{
+    const auto first_key = radix_order(invoke_projection(proj, *first));
+    typename std::remove_const<decltype(first_key)>::type changed_bits = 0;
+
+    for (RandomIt it = first; it != last; ++it)
+    {
+        changed_bits |= radix_order(invoke_projection(proj, *it)) ^ first_key;
+    }
+
+    size_t passes = 0;
+
+    for (size_t d = 0; d != sizeof(first_key); ++d)
+    {
+        if ((changed_bits >> (8 * d)) & 0xFF)
+        {
+            ++passes;
+        }
+    }
+
+    return passes;
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) by the integer keys 'proj' projects its        *
+* elements to with the least significant digit first radix sort, which is      *
+* stable. The digits are bytes, and the passes over the bytes that are equal   *
+* in all the keys are skipped. 'buffer' must point to at least as many         *
+* elements as there are in the range. If 'buffer_is_raw' is true, the buffer   *
+* is uninitialized storage. Returns true if the elements of a raw buffer were  *
+* constructed and must be destroyed by the caller. If the projection throws    *
+* after the buffer is constructed, its elements are destroyed.                 *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Proj>
+bool radix_sort_by_key(RandomIt first,
+                       RandomIt last,
+                       BufferIt buffer,
+                       const Proj& proj,
+                       const bool buffer_is_raw)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    typedef typename projected_key<Proj, value_type>::type key_type;
+
+    const size_t length = std::distance(first, last);
+    const size_t digits = sizeof(key_type);
+
+    // Count the digits of all the passes while reading the keys once.
+    size_t counts[digits][256] = {};
+
+    for (RandomIt it = first; it != last; ++it)
+    {
+        const auto key = radix_order(invoke_projection(proj, *it));
+
+        for (size_t d = 0; d != digits; ++d)
+        {
+            ++counts[d][(key >> (8 * d)) & 0xFF];
+        }
+    }
+
+    bool data_in_buffer = false;
+    bool buffer_constructed = !buffer_is_raw;
+    raw_storage_guard<BufferIt> guard(buffer);
+
+    for (size_t d = 0; d != digits; ++d)
+    {
+        size_t* offsets = counts[d];
+
+        if (std::find(offsets, offsets + 256, length) != offsets + 256)
+        {
+            // All the keys have the same digit, so it orders nothing.
+            continue;
+        }
+
+        size_t offset = 0;
+
+        for (size_t i = 0; i != 256; ++i)
+        {
+            const size_t count = offsets[i];
+            offsets[i] = offset;
+            offset += count;
+        }
+
+        if (data_in_buffer)
+        {
+            radix_scatter(buffer, length, first, proj, 8 * d, offsets);
+        }
+        else if (buffer_constructed)
+        {
+            radix_scatter(first, length, buffer, proj, 8 * d, offsets);
+        }
+        else
+        {
+            radix_scatter(first,
+                          length,
+                          make_constructing_iterator(buffer),
+                          proj,
+                          8 * d,
+                          offsets);
+
+            // The scatter constructs the elements out of order, so they are
+            // counted only once all of them are.
+            guard.constructed() = length;
+            buffer_constructed = true;
+        }
+
+        data_in_buffer = !data_in_buffer;
+    }
+
+    if (data_in_buffer)
+    {
+        std::move(buffer, buffer + length, first);
+    }
+
+    guard.release();
+    return buffer_is_raw && buffer_constructed;
+}
+
+/*******************************************************************************
+* Lists the strategies the presortedness probe chooses between.                *
+*******************************************************************************/
+enum class SortStrategy {
+    NATURAL_MERGE,
+    EXTENDED_RUN_MERGE,
+    RADIX_SORT
+};
+
+/*******************************************************************************
+* Returns the mean length of the runs in 'PROBE_WINDOW_AMOUNT' windows of      *
+* 'PROBE_WINDOW_LENGTH' elements spread evenly over the range [first, last),   *
+* which must be at least 'PROBE_MINIMUM_LENGTH' elements long. The runs are    *
+* scanned like in 'scan_runs', but end at the end of their window, so that     *
+* the mean is at most a window long.                                           *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+size_t probe_mean_run_length(RandomIt first, RandomIt last, Cmp cmp)
+{
+    const size_t length = std::distance(first, last);
+    size_t runs = 0;
+
+    for (size_t i = 0; i != PROBE_WINDOW_AMOUNT; ++i)
+    {
+        RandomIt head = first + (length - PROBE_WINDOW_LENGTH) * i /
+                                (PROBE_WINDOW_AMOUNT - 1);
+        const RandomIt window_lst = head + (PROBE_WINDOW_LENGTH - 1);
+
+        while (head <= window_lst)
+        {
+            if (head == window_lst)
+            {
+                head = window_lst + 1;
+            }
+            else if (cmp(*(head + 1), *head))
+            {
+                head = find_descending_run_end(head + 1,
+                                               window_lst,
+                                               cmp,
+                                               std::false_type()) + 1;
+            }
+            else
+            {
+                head = find_ascending_run_end(head + 1,
+                                              window_lst,
+                                              cmp,
+                                              std::false_type()) + 1;
+            }
+
+            ++runs;
+        }
+    }
+
+    return PROBE_WINDOW_AMOUNT * PROBE_WINDOW_LENGTH / runs;
+}
+
+/*******************************************************************************
+* Tells whether radix sorting the range [first, last) of short runs takes      *
+* fewer passes than merging its runs extended to the recommended length, by    *
+* the same measure as 'sort_runs'.                                             *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+bool prefers_radix_sort(RandomIt first,
+                        RandomIt last,
+                        Cmp cmp,
+                        std::true_type)
+{
+    const size_t length = std::distance(first, last);
+    const double merge_passes =
+            (double) get_pass_amount(length / RECOMMENDED_MINIMUM_RUN_LENGTH);
+
+    return merge_passes > RADIX_SORT_PASS_COST &&
+           merge_passes > RADIX_SORT_PASS_COST *
+                          count_radix_passes(first, last, cmp.proj);
+}
+
+template<class RandomIt, class Cmp>
+bool prefers_radix_sort(RandomIt, RandomIt, Cmp, std::false_type)
+{
+    return false;
+}
+
+/*******************************************************************************
+* Radix sorts the range [first, last) by the keys of 'cmp'. Only called for    *
+* the comparators that allow it.                                               *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+bool radix_sort_by_comparator(RandomIt first,
+                              RandomIt last,
+                              BufferIt buffer,
+                              Cmp cmp,
+                              const bool buffer_is_raw,
+                              std::true_type)
+{
+    return radix_sort_by_key(first, last, buffer, cmp.proj, buffer_is_raw);
+}
+
+template<class RandomIt, class BufferIt, class Cmp>
+bool radix_sort_by_comparator(RandomIt,
+                              RandomIt,
+                              BufferIt,
+                              Cmp,
+                              const bool,
+                              std::false_type)
+{
+    return false;
+}
+
+/*******************************************************************************
+* Chooses how to sort the range [first, last) as specified by 'options'. If    *
+* the probe is on and finds the runs of the range short, the range is radix    *
+* sorted when its keys allow and that takes fewer passes, and its runs are     *
+* extended to 'RECOMMENDED_MINIMUM_RUN_LENGTH' otherwise, unless the options   *
+* ask for a minimum run length of their own. Any other range is merged as is.  *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+SortStrategy choose_sort_strategy(RandomIt first,
+                                  RandomIt last,
+                                  Cmp cmp,
+                                  const NaturalMergeSortOptions& options)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    if (!options.presortedness_probe ||
+        (size_t) std::distance(first, last) < PROBE_MINIMUM_LENGTH ||
+        probe_mean_run_length(first, last, cmp) >= PROBE_SHORT_RUN_LENGTH)
+    {
+        return SortStrategy::NATURAL_MERGE;
+    }
+
+    if (prefers_radix_sort(first,
+                           last,
+                           cmp,
+                           typename is_radix_sortable<value_type, Cmp>::type()))
+    {
+        return SortStrategy::RADIX_SORT;
+    }
+
+    return options.minimum_run_length < 2 ? SortStrategy::EXTENDED_RUN_MERGE :
+                                            SortStrategy::NATURAL_MERGE;
+}
+
+/*******************************************************************************
+* Returns a copy of 'options' extending the runs to the recommended length     *
+* without probing again.                                                       *
+*******************************************************************************/
+inline NaturalMergeSortOptions get_extended_run_options(
+        const NaturalMergeSortOptions& options)
+{
+    NaturalMergeSortOptions extended = options;
+    extended.presortedness_probe = false;
+    extended.minimum_run_length = RECOMMENDED_MINIMUM_RUN_LENGTH;
+    return extended;
+}
+
+/*******************************************************************************
+* Sorts the range [first, last), whose runs are stored in the run queue        *
+* pointed to by 'p_queue', by merging the runs as given by 'options'. Returns  *
+* true if the elements of a raw buffer were constructed and must be destroyed  *
+* by the caller.                                                               *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Int, class Cmp>
+bool sort_runs(RandomIt first,
+               RandomIt last,
+               BufferIt buffer,
+               UnsafeIntQueue<Int>* p_queue,
+               Cmp cmp,
+               const bool buffer_is_raw,
+               const NaturalMergeSortOptions& options,
+               std::false_type)
+{
+    return merge_runs(first,
+                      last,
+                      buffer,
+                      p_queue,
+                      cmp,
+                      buffer_is_raw,
+                      options);
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) of elements with integer keys, whose runs are  *
+* stored in the run queue pointed to by 'p_queue'. The range is radix sorted   *
+* if merging its runs would take more than 'RADIX_SORT_PASS_COST' merge passes *
+* per radix sort pass, and the runs are merged otherwise, so that presorted    *
+* ranges keep the linear best case.                                            *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Int, class Cmp>
+bool sort_runs(RandomIt first,
+               RandomIt last,
+               BufferIt buffer,
+               UnsafeIntQueue<Int>* p_queue,
+               Cmp cmp,
+               const bool buffer_is_raw,
+               const NaturalMergeSortOptions& options,
+               std::true_type)
+{
+    const double merge_passes = (double) get_pass_amount(p_queue->size());
+
+    if (p_queue->size() > 1 && merge_passes > RADIX_SORT_PASS_COST)
+    {
+        const size_t radix_passes = count_radix_passes(first, last, cmp.proj);
+
+        if (merge_passes > RADIX_SORT_PASS_COST * radix_passes)
+        {
+            return radix_sort_by_key(first,
+                                     last,
+                                     buffer,
+                                     cmp.proj,
+                                     buffer_is_raw);
+        }
+    }
+
+    return merge_runs(first,
+                      last,
+                      buffer,
+                      p_queue,
+                      cmp,
+                      buffer_is_raw,
+                      options);
+}
+
+template<class RandomIt, class BufferIt, class Int, class Cmp>
+bool sort_runs(RandomIt first,
+               RandomIt last,
+               BufferIt buffer,
+               UnsafeIntQueue<Int>* p_queue,
+               Cmp cmp,
+               const bool buffer_is_raw,
+               const NaturalMergeSortOptions& options)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    stats_record_runs(options.p_stats, *p_queue);
+
+    return sort_runs(first,
+                     last,
+                     buffer,
+                     p_queue,
+                     cmp,
+                     buffer_is_raw,
+                     options,
+                     typename is_radix_sortable<value_type, Cmp>::type());
+}
+
+/*******************************************************************************
+* The actual implementation of natural merge sort storing the run lengths as   *
+* 'Int's. Returns true if the elements of a raw buffer were constructed and    *
+* must be destroyed by the caller.                                             *
+*******************************************************************************/
+template<class Int, class RandomIt, class BufferIt, class Cmp>
+bool natural_merge_sort_impl(RandomIt first, 
+                             RandomIt last, 
+                             BufferIt buffer,
+                             Cmp cmp,
+                             const bool buffer_is_raw,
+                             const NaturalMergeSortOptions& options)
+{
+    // Scan the runs.
+    UnsafeIntQueue<Int> queue;
+    build_run_size_queue(first,
+                         last,
+                         cmp,
+                         queue,
+                         options.minimum_run_length,
+                         options.stable);
+    return sort_runs(first, last, buffer, &queue, cmp, buffer_is_raw, options);
+}
+
+/*******************************************************************************
+* The actual implementation of natural merge sort. Returns true if the         *
+* elements of a raw buffer were constructed and must be destroyed by the       *
+* caller.                                                                      *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+bool natural_merge_sort_impl(RandomIt first, 
+                             RandomIt last, 
+                             BufferIt buffer,
+                             Cmp cmp,
+                             const bool buffer_is_raw,
+                             const NaturalMergeSortOptions& options)
+{
+    const size_t length = std::distance(first, last);
+
+    if (length < 2)
+    {
+        // Trivially sorted.
+        return false;
+    }
+
+#ifdef NATURAL_MERGE_SORT_STATS
+    if (counts_comparisons<Cmp>(options))
+    {
+        return natural_merge_sort_impl(
+                first,
+                last,
+                buffer,
+                make_counting_comparator(cmp, options.p_stats),
+                buffer_is_raw,
+                options);
+    }
+#endif
+
+    if (options.scratch_budget < length)
+    {
+        bounded_natural_merge_sort(first,
+                                   last,
+                                   buffer,
+                                   options.scratch_budget,
+                                   cmp,
+                                   buffer_is_raw,
+                                   options);
+        return false;
+    }
+
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    switch (choose_sort_strategy(first, last, cmp, options))
+    {
+        case SortStrategy::RADIX_SORT:
+            return radix_sort_by_comparator(
+                    first,
+                    last,
+                    buffer,
+                    cmp,
+                    buffer_is_raw,
+                    typename is_radix_sortable<value_type, Cmp>::type());
+
+        case SortStrategy::EXTENDED_RUN_MERGE:
+            return natural_merge_sort_impl(first,
+                                           last,
+                                           buffer,
+                                           cmp,
+                                           buffer_is_raw,
+                                           get_extended_run_options(options));
+
+        case SortStrategy::NATURAL_MERGE:
+            break;
+    }
+
+    if (run_lengths_fit_32_bits(length))
+    {
+        return natural_merge_sort_impl<uint32_t>(first,
+                                                 last,
+                                                 buffer,
+                                                 cmp,
+                                                 buffer_is_raw,
+                                                 options);
+    }
+
+    return natural_merge_sort_impl<size_t>(first,
+                                           last,
+                                           buffer,
+                                           cmp,
+                                           buffer_is_raw,
+                                           options);
+}
+
+/*******************************************************************************
+* Implements a reusable scratch buffer for the sorts. The buffer holds raw     *
+* storage obtained from the allocator 'Alloc' and only grows, so that keeping  *
+* a buffer alive between the sorts makes the steady-state sorting free of      *
+* allocations. A sort constructs the elements in the buffer only when it       *
+* writes them for the first time and destroys them before it returns, also     *
+* when its comparator throws.                                                  *
+*******************************************************************************/
+template<class T, class Alloc = std::allocator<T>>
+class ScratchBuffer {
+private:
+
+    typedef std::allocator_traits<Alloc> allocator_traits;
+
+    Alloc m_allocator;
+    T* m_buffer;
+    size_t m_capacity;
+
+public:
+
+    explicit ScratchBuffer(const Alloc& allocator = Alloc()) :
+    m_allocator(allocator),
+    m_buffer{nullptr},
+    m_capacity{0}
+    {}
+
+    ScratchBuffer(const ScratchBuffer&) = delete;
+    ScratchBuffer& operator=(const ScratchBuffer&) = delete;
+
+    ~ScratchBuffer()
+    {
+        release();
+    }
+
+    /***************************************************************************
+    * Makes sure the buffer can accommodate at least 'capacity' elements. The  *
+    * buffer must not hold any constructed elements.                           *
+    ***************************************************************************/
+    void reserve(const size_t capacity)
+    {
+        if (capacity <= m_capacity)
+        {
+            return;
+        }
+
+        release();
+        m_buffer = allocator_traits::allocate(m_allocator, capacity);
+        m_capacity = capacity;
+    }
+
+    /***************************************************************************
+    * Returns the storage of this buffer to the allocator.                     *
+    ***************************************************************************/
+    void release()
+    {
+        if (m_buffer)
+        {
+            allocator_traits::deallocate(m_allocator, m_buffer, m_capacity);
+            m_buffer = nullptr;
+            m_capacity = 0;
+        }
+    }
+
+    T* data() const
+    {
+        return m_buffer;
+    }
+
+    size_t capacity() const
+    {
+        return m_capacity;
+    }
+};
+
+/*******************************************************************************
+* Tells whether raw storage for 'T's must be constructed before it is used. A  *
+* trivial type needs no construction, so its scratch storage is used as if it  *
+* were constructed, which lets the merges write to it through plain pointers.  *
+*******************************************************************************/
+template<class T>
+struct storage_needs_construction :
+        std::integral_constant<bool, !std::is_trivial<T>::value> {};
+
+/*******************************************************************************
+* Returns the amount of scratch elements 'natural_merge_sort' needs for        *
+* sorting a range of 'length' elements.                                        *
+*******************************************************************************/
+inline size_t natural_merge_sort_scratch_size(const size_t length)
+{
+    return length;
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) as specified by 'options' using the caller-    *
+* supplied 'buffer', which must point to at least                              *
+* 'natural_merge_sort_scratch_size(last - first)' constructed elements. The    *
+* contents of the buffer are overwritten.                                      *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+void natural_merge_sort(RandomIt first,
+                        RandomIt last,
+                        BufferIt buffer,
+                        Cmp cmp,
+                        const NaturalMergeSortOptions& options)
+{
+    natural_merge_sort_impl(first, last, buffer, cmp, false, options);
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) using the caller-supplied 'buffer', which must *
+* point to at least 'natural_merge_sort_scratch_size(last - first)' construc-  *
+* ted elements. The contents of the buffer are overwritten.                    *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+void natural_merge_sort(RandomIt first, RandomIt last, BufferIt buffer, Cmp cmp)
+{
+    natural_merge_sort(first, last, buffer, cmp, NaturalMergeSortOptions());
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) using the storage of 'scratch' and storing the *
+* run lengths as 'Int's. The runs are scanned before the scratch buffer is     *
+* grown, so that sorting a presorted range never allocates it.                 *
+*******************************************************************************/
+template<class Int, class RandomIt, class Cmp, class T, class Alloc>
+void natural_merge_sort_with_scratch(RandomIt first,
+                                     RandomIt last,
+                                     Cmp cmp,
+                                     ScratchBuffer<T, Alloc>& scratch,
+                                     const NaturalMergeSortOptions& options)
+{
+    UnsafeIntQueue<Int> queue;
+    build_run_size_queue(first,
+                         last,
+                         cmp,
+                         queue,
+                         options.minimum_run_length,
+                         options.stable);
+
+    if (queue.size() < 2)
+    {
+        // Already sorted.
+        stats_record_runs(options.p_stats, queue);
+        return;
+    }
+
+    const size_t length = std::distance(first, last);
+    scratch.reserve(natural_merge_sort_scratch_size(length));
+
+    T* buffer = scratch.data();
+
+    if (sort_runs(first,
+                  last,
+                  buffer,
+                  &queue,
+                  cmp,
+                  storage_needs_construction<T>::value,
+                  options))
+    {
+        destroy_range(buffer, buffer + length);
+    }
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) as specified by 'options' using the storage of *
+* 'scratch', which is grown when it is too small for the range.                *
+*******************************************************************************/
+template<class RandomIt, class Cmp, class T, class Alloc>
+void natural_merge_sort(RandomIt first,
+                        RandomIt last,
+                        Cmp cmp,
+                        ScratchBuffer<T, Alloc>& scratch,
+                        const NaturalMergeSortOptions& options)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    static_assert(std::is_same<T, value_type>::value,
+                  "The scratch buffer must hold elements of the sorted type.");
+
+    const size_t length = std::distance(first, last);
+
+    if (length < 2)
+    {
+        // Trivially sorted.
+        return;
+    }
+
+#ifdef NATURAL_MERGE_SORT_STATS
+    if (counts_comparisons<Cmp>(options))
+    {
+        natural_merge_sort(first,
+                           last,
+                           make_counting_comparator(cmp, options.p_stats),
+                           scratch,
+                           options);
+        return;
+    }
+#endif
+
+    if (options.scratch_budget < natural_merge_sort_scratch_size(length))
+    {
+        scratch.reserve(options.scratch_budget);
+        bounded_natural_merge_sort(first,
+                                   last,
+                                   scratch.data(),
+                                   options.scratch_budget,
+                                   cmp,
+                                   storage_needs_construction<T>::value,
+                                   options);
+        return;
+    }
+
+    switch (choose_sort_strategy(first, last, cmp, options))
+    {
+        case SortStrategy::RADIX_SORT:
+
+            scratch.reserve(length);
+
+            if (radix_sort_by_comparator(
+                    first,
+                    last,
+                    scratch.data(),
+                    cmp,
+                    storage_needs_construction<T>::value,
+                    typename is_radix_sortable<value_type, Cmp>::type()))
+            {
+                destroy_range(scratch.data(), scratch.data() + length);
+            }
+
+            return;
+
+        case SortStrategy::EXTENDED_RUN_MERGE:
+            natural_merge_sort(first,
+                               last,
+                               cmp,
+                               scratch,
+                               get_extended_run_options(options));
+            return;
+
+        case SortStrategy::NATURAL_MERGE:
+            break;
+    }
+
+    if (run_lengths_fit_32_bits(length))
+    {
+        natural_merge_sort_with_scratch<uint32_t>(first,
+                                                  last,
+                                                  cmp,
+                                                  scratch,
+                                                  options);
+    }
+    else
+    {
+        natural_merge_sort_with_scratch<size_t>(first,
+                                                last,
+                                                cmp,
+                                                scratch,
+                                                options);
+    }
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) using the storage of 'scratch', which is grown *
+* when it is too small for the range.                                          *
+*******************************************************************************/
+template<class RandomIt, class Cmp, class T, class Alloc>
+void natural_merge_sort(RandomIt first,
+                        RandomIt last,
+                        Cmp cmp,
+                        ScratchBuffer<T, Alloc>& scratch)
+{
+    natural_merge_sort(first, last, cmp, scratch, NaturalMergeSortOptions());
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) as specified by 'options'. This overload       *
+* allocates the scratch buffer with the standard allocator.                    *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+void natural_merge_sort(RandomIt first,
+                        RandomIt last,
+                        Cmp cmp,
+                        const NaturalMergeSortOptions& options)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    ScratchBuffer<value_type> scratch;
+    natural_merge_sort(first, last, cmp, scratch, options);
+}
+
+/*******************************************************************************
+* Implements the natural merge sort, which sacrifices one pass over the input  *
+* range in order to establish an implicit queue of runs. A run is the longest  *
+* consecutive subsequence, in which all elements are ascending or strictly     *
+* descending. Every descending run is reversed to ascending run. We cannot     *
+* consider non-strictly descending runs, since that would sacrifice the stabi- *
+* lity of the algorithm. After the run queue is establish, the algorithm re-   *
+* moves two runs from the head of the queue, merges them into one run, which   *
+* is then appended to the tail of the run queue. Merging continues until the   *
+* queue contains only one run, which denotes that the entire input range is    *
+* sorted.                                                                      *
+*                                                                              *
+* This overload allocates the scratch buffer with the standard allocator. The  *
+* runs may be merged in another order by passing 'NaturalMergeSortOptions'     *
+* with a different 'merge_policy'.                                             *
+*                                                                              *
+* The best-case complexity is O(N), the average and worst-case complexity is   *
+* O(N log N). Space complexity is O(N).                                        *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+void natural_merge_sort(RandomIt first, RandomIt last, Cmp cmp)
+{
+    natural_merge_sort(first, last, cmp, NaturalMergeSortOptions());
+}
+
+/*******************************************************************************
+* Sorts the range [first, last), whose prefix [first, middle) is sorted, as    *
+* specified by 'options' using the storage of 'scratch'. Only the tail         *
+* [middle, last) is sorted, after which it is merged into the prefix with a    *
+* single galloping merge, so that appending a batch of T elements to a sorted  *
+* range of N elements costs O(T log T + N) instead of a sort of the whole      *
+* range. The prefix is neither scanned nor checked. The merge needs at most T  *
+* elements of scratch space; under a smaller 'scratch_budget', it splits the   *
+* runs by rotation as in the bounded sorts.                                    *
+*******************************************************************************/
+template<class RandomIt, class Cmp, class T, class Alloc>
+void natural_merge_sort_append(RandomIt first,
+                               RandomIt middle,
+                               RandomIt last,
+                               Cmp cmp,
+                               ScratchBuffer<T, Alloc>& scratch,
+                               const NaturalMergeSortOptions& options)
+{
+#ifdef NATURAL_MERGE_SORT_STATS
+    if (counts_comparisons<Cmp>(options))
+    {
+        natural_merge_sort_append(first,
+                                  middle,
+                                  last,
+                                  make_counting_comparator(cmp,
+                                                           options.p_stats),
+                                  scratch,
+                                  options);
+        return;
+    }
+#endif
+
+    natural_merge_sort(middle, last, cmp, scratch, options);
+
+    if (first == middle || middle == last || !cmp(*middle, *(middle - 1)))
+    {
+        // The tail goes after the prefix as is.
+        return;
+    }
+
+    const size_t buffer_size = std::min(options.scratch_budget,
+                                        (size_t) std::distance(middle, last));
+    scratch.reserve(buffer_size);
+
+    T* buffer = scratch.data();
+    raw_storage_guard<T*> guard(buffer);
+
+    merge_adjacent_runs_bounded(first,
+                                middle,
+                                last,
+                                buffer,
+                                buffer_size,
+                                cmp,
+                                storage_needs_construction<T>::value,
+                                guard.constructed());
+}
+
+/*******************************************************************************
+* Sorts the range [first, last), whose prefix [first, middle) is sorted, by    *
+* sorting the tail [middle, last) and merging it into the prefix, using the    *
+* storage of 'scratch'.                                                        *
+*******************************************************************************/
+template<class RandomIt, class Cmp, class T, class Alloc>
+void natural_merge_sort_append(RandomIt first,
+                               RandomIt middle,
+                               RandomIt last,
+                               Cmp cmp,
+                               ScratchBuffer<T, Alloc>& scratch)
+{
+    natural_merge_sort_append(first,
+                              middle,
+                              last,
+                              cmp,
+                              scratch,
+                              NaturalMergeSortOptions());
+}
+
+/*******************************************************************************
+* Sorts the range [first, last), whose prefix [first, middle) is sorted, by    *
+* sorting the tail [middle, last) and merging it into the prefix as specified  *
+* by 'options'. This overload allocates the scratch buffer with the standard   *
+* allocator.                                                                   *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+void natural_merge_sort_append(RandomIt first,
+                               RandomIt middle,
+                               RandomIt last,
+                               Cmp cmp,
+                               const NaturalMergeSortOptions& options)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    ScratchBuffer<value_type> scratch;
+    natural_merge_sort_append(first, middle, last, cmp, scratch, options);
+}
+
+/*******************************************************************************
+* Sorts the range [first, last), whose prefix [first, middle) is sorted, by    *
+* sorting the tail [middle, last) and merging it into the prefix.              *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+void natural_merge_sort_append(RandomIt first,
+                               RandomIt middle,
+                               RandomIt last,
+                               Cmp cmp)
+{
+    natural_merge_sort_append(first,
+                              middle,
+                              last,
+                              cmp,
+                              NaturalMergeSortOptions());
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) as specified by 'options' by the keys 'proj'   *
+* projects the elements to, which are ordered by 'key_cmp'. If the keys are    *
+* integers ordered by 'std::less', a range with many runs is radix sorted,     *
+* while a presorted range is still merged.                                     *
+*******************************************************************************/
+template<class RandomIt, class Proj, class KeyCmp>
+void natural_merge_sort_by_key(RandomIt first,
+                               RandomIt last,
+                               Proj proj,
+                               KeyCmp key_cmp,
+                               const NaturalMergeSortOptions& options)
+{
+    natural_merge_sort(first,
+                       last,
+                       make_projected_comparator(proj, key_cmp),
+                       options);
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) by the keys 'proj' projects the elements to,   *
+* which are ordered by 'key_cmp'.                                              *
+*******************************************************************************/
+template<class RandomIt, class Proj, class KeyCmp>
+void natural_merge_sort_by_key(RandomIt first,
+                               RandomIt last,
+                               Proj proj,
+                               KeyCmp key_cmp)
+{
+    natural_merge_sort_by_key(first,
+                              last,
+                              proj,
+                              key_cmp,
+                              NaturalMergeSortOptions());
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) by the keys 'proj' projects the elements to,   *
+* which are ordered by 'std::less'.                                            *
+*******************************************************************************/
+template<class RandomIt, class Proj>
+void natural_merge_sort_by_key(RandomIt first, RandomIt last, Proj proj)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    typedef typename projected_key<Proj, value_type>::type key_type;
+    natural_merge_sort_by_key(first, last, proj, std::less<key_type>());
+}
+
+/*******************************************************************************
+* An element of the array the indirect sort sorts: the prefix of the key of    *
+* the record at 'index'.                                                       *
+*******************************************************************************/
+template<class Key>
+struct indirect_entry {
+    Key prefix;
+    size_t index;
+};
+
+/*******************************************************************************
+* Returns the index of the record an entry of the indirect array stands for.   *
+*******************************************************************************/
+inline size_t& get_indirect_index(size_t& index)
+{
+    return index;
+}
+
+template<class Key>
+size_t& get_indirect_index(indirect_entry<Key>& entry)
+{
+    return entry.index;
+}
+
+/*******************************************************************************
+* Orders the indices of the records of the range starting at 'first' by        *
+* 'cmp' on the records.                                                        *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+struct indirect_comparator {
+    RandomIt first;
+    Cmp cmp;
+
+    indirect_comparator(RandomIt first, Cmp cmp) :
+    first(first),
+    cmp(cmp)
+    {}
+
+    bool operator()(const size_t a, const size_t b) const
+    {
+        return cmp(first[a], first[b]);
+    }
+};
+
+/*******************************************************************************
+* Orders the entries by their key prefixes, and those with equal prefixes by   *
+* 'cmp' on their records in the range starting at 'first'.                     *
+*******************************************************************************/
+template<class RandomIt, class Key, class Cmp>
+struct indirect_prefix_comparator {
+    RandomIt first;
+    Cmp cmp;
+
+    indirect_prefix_comparator(RandomIt first, Cmp cmp) :
+    first(first),
+    cmp(cmp)
+    {}
+
+    bool operator()(const indirect_entry<Key>& a,
+                    const indirect_entry<Key>& b) const
+    {
+        if (a.prefix < b.prefix)
+        {
+            return true;
+        }
+
+        if (b.prefix < a.prefix)
+        {
+            return false;
+        }
+
+        return cmp(first[a.index], first[b.index]);
+    }
+};
+
+/*******************************************************************************
+* Moves the records of the range starting at 'first' so that the record at     *
+* 'get_indirect_index(entries[i])' ends up at 'i', for every 'i' less than     *
+* 'length'. The permutation is applied in place one cycle at a time, moving    *
+* every record once plus once more per cycle. The indices of the entries are   *
+* overwritten.                                                                 *
+*******************************************************************************/
+template<class RandomIt, class EntryIt>
+void apply_indirect_permutation(RandomIt first,
+                                EntryIt entries,
+                                const size_t length)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    for (size_t i = 0; i != length; ++i)
+    {
+        if (get_indirect_index(entries[i]) == i)
+        {
+            continue;
+        }
+
+        value_type value = std::move(first[i]);
+        size_t hole = i;
+
+        while (true)
+        {
+            const size_t source = get_indirect_index(entries[hole]);
+
+            // Mark the position as done.
+            get_indirect_index(entries[hole]) = hole;
+
+            if (source == i)
+            {
+                break;
+            }
+
+            first[hole] = std::move(first[source]);
+            hole = source;
+        }
+
+        first[hole] = std::move(value);
+    }
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) as specified by 'options' by sorting an array  *
+* of the indices of its records and permuting the records once at the end.     *
+* Pays off for the records that are expensive to move, as the merge passes     *
+* move the indices only, but every comparison dereferences two records.        *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+void natural_merge_sort_indirect(RandomIt first,
+                                 RandomIt last,
+                                 Cmp cmp,
+                                 const NaturalMergeSortOptions& options)
+{
+    const size_t length = std::distance(first, last);
+
+    if (length < 2)
+    {
+        // Trivially sorted.
+        return;
+    }
+
+    std::vector<size_t> indices(length);
+
+    for (size_t i = 0; i != length; ++i)
+    {
+        indices[i] = i;
+    }
+
+    natural_merge_sort(indices.begin(),
+                       indices.end(),
+                       indirect_comparator<RandomIt, Cmp>(first, cmp),
+                       options);
+    apply_indirect_permutation(first, indices.begin(), length);
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) by sorting an array of the indices of its      *
+* records and permuting the records once at the end.                           *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+void natural_merge_sort_indirect(RandomIt first, RandomIt last, Cmp cmp)
+{
+    natural_merge_sort_indirect(first, last, cmp, NaturalMergeSortOptions());
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) as specified by 'options' like                 *
+* 'natural_merge_sort_indirect', but caches the key prefix 'prefix' projects   *
+* each record to next to its index, so that only the ties on the prefixes      *
+* dereference the records. The prefixes must agree with 'cmp': if the prefix   *
+* of 'a' is less than that of 'b', 'cmp(a, b)' must hold.                      *
+*******************************************************************************/
+template<class RandomIt, class Prefix, class Cmp>
+void natural_merge_sort_indirect_by_prefix(
+        RandomIt first,
+        RandomIt last,
+        Prefix prefix,
+        Cmp cmp,
+        const NaturalMergeSortOptions& options)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    typedef typename projected_key<Prefix, value_type>::type key_type;
+
+    const size_t length = std::distance(first, last);
+
+    if (length < 2)
+    {
+        // Trivially sorted.
+        return;
+    }
+
+    std::vector<indirect_entry<key_type>> entries(length);
+
+    for (size_t i = 0; i != length; ++i)
+    {
+        entries[i].prefix = invoke_projection(prefix, first[i]);
+        entries[i].index = i;
+    }
+
+    natural_merge_sort(
+            entries.begin(),
+            entries.end(),
+            indirect_prefix_comparator<RandomIt, key_type, Cmp>(first, cmp),
+            options);
+    apply_indirect_permutation(first, entries.begin(), length);
+}
+
+/*******************************************************************************
+* Sorts the range [first, last) like 'natural_merge_sort_indirect', caching    *
+* the key prefixes 'prefix' projects the records to.                           *
+*******************************************************************************/
+template<class RandomIt, class Prefix, class Cmp>
+void natural_merge_sort_indirect_by_prefix(RandomIt first,
+                                           RandomIt last,
+                                           Prefix prefix,
+                                           Cmp cmp)
+{
+    natural_merge_sort_indirect_by_prefix(first,
+                                          last,
+                                          prefix,
+                                          cmp,
+                                          NaturalMergeSortOptions());
+}
+
+#ifdef USE_POSIX_THREADS
+/*******************************************************************************
+* Runs the task pointed to by 'args' in a freshly spawned POSIX thread.        *
+*******************************************************************************/
+inline void* task_thread_proxy(void* args)
+{
+    (*(std::function<void()>*) args)();
+    return nullptr;
+}
+#endif
+
+/*******************************************************************************
+* Reads the first two numbers of the file 'path' to 'first' and 'second'.      *
+* Returns the amount of numbers read. A word that is not a number, such as the *
+* 'max' of an unlimited cgroup quota, ends the reading.                        *
+*******************************************************************************/
+inline int read_cgroup_numbers(const char* path,
+                               long long& first,
+                               long long& second)
+{
+    std::ifstream file(path);
+    int count = 0;
+
+    if (file >> first)
+    {
+        ++count;
+
+        if (file >> second)
+        {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+/*******************************************************************************
+* Counts the CPUs the process may keep busy. On Linux, this is the smallest of *
+* the hardware concurrency, the CPUs in the affinity mask of the process and   *
+* the CPU quota of its cgroup, rounded up, so that a container limited to a    *
+* few CPUs is not oversubscribed. The result is at least one, also when the    *
+* hardware concurrency is unknown.                                             *
+*******************************************************************************/
+inline size_t count_available_cpus()
+{
+    size_t cpus = std::thread::hardware_concurrency();
+
+#ifdef __linux__
+    cpu_set_t affinity;
+
+    if (sched_getaffinity(0, sizeof(affinity), &affinity) == 0)
+    {
+        const size_t affinity_cpus = CPU_COUNT(&affinity);
+
+        if (affinity_cpus > 0 && (cpus == 0 || affinity_cpus < cpus))
+        {
+            cpus = affinity_cpus;
+        }
+    }
+
+    // The quota and the period of cgroup v2, or else of cgroup v1.
+    long long quota = 0;
+    long long period = 0;
+    long long unused = 0;
+
+    const char* const v2_max = "/sys/fs/cgroup/cpu.max";
+    const char* const v1_quota = "/sys/fs/cgroup/cpu/cpu.cfs_quota_us";
+    const char* const v1_period = "/sys/fs/cgroup/cpu/cpu.cfs_period_us";
+
+    if (read_cgroup_numbers(v2_max, quota, period) != 2 &&
+        (read_cgroup_numbers(v1_quota, quota, unused) != 1 ||
+         read_cgroup_numbers(v1_period, period, unused) != 1))
+    {
+        quota = 0;
+    }
+
+    if (quota > 0 && period > 0)
+    {
+        const size_t quota_cpus = (size_t)((quota + period - 1) / period);
+
+        if (cpus == 0 || quota_cpus < cpus)
+        {
+            cpus = quota_cpus;
+        }
+    }
+#endif
+
+    return std::max(cpus, (size_t) 1);
+}
+
+/*******************************************************************************
+* Returns the amount of CPUs the process may keep busy as given by             *
+* 'count_available_cpus'. The count reads a few files, so it is done once, on  *
+* the first call; later changes of the affinity or the quota are not seen.     *
+*******************************************************************************/
+inline size_t available_cpu_count()
+{
+    static const size_t cpus = count_available_cpus();
+    return cpus;
+}
+
+/*******************************************************************************
+* Parses a list of CPUs such as "0-3,8,10-11" as used by the sysfs.            *
+*******************************************************************************/
+inline std::vector<int> parse_cpu_list(const std::string& list)
+{
+    std::vector<int> cpus;
+    size_t position = 0;
+
+    while (position < list.size())
+    {
+        size_t end = list.find(',', position);
+        end = end == std::string::npos ? list.size() : end;
+
+        const std::string range = list.substr(position, end - position);
+        const size_t dash = range.find('-');
+        const int first = std::atoi(range.c_str());
+        const int last = dash == std::string::npos ?
+                         first : std::atoi(range.c_str() + dash + 1);
+
+        for (int cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+
+        position = end + 1;
+    }
+
+    return cpus;
+}
+
+/*******************************************************************************
+* Returns the CPUs of each NUMA node with CPUs, as listed in the sysfs. The    *
+* list is empty where the nodes are unknown.                                   *
+*******************************************************************************/
+inline std::vector<std::vector<int>> numa_node_cpus()
+{
+    std::vector<std::vector<int>> nodes;
+
+#ifdef __linux__
+    std::ifstream online("/sys/devices/system/node/online");
+    std::string online_list;
+
+    if (!(online >> online_list))
+    {
+        return nodes;
+    }
+
+    for (const int node : parse_cpu_list(online_list))
+    {
+        std::ifstream file("/sys/devices/system/node/node" +
+                           std::to_string(node) + "/cpulist");
+        std::string cpu_list;
+
+        if (file >> cpu_list)
+        {
+            nodes.push_back(parse_cpu_list(cpu_list));
+        }
+    }
+#endif
+
+    return nodes;
+}
+
+/*******************************************************************************
+* Implements a pool of worker threads, which stay alive between the sorts, so  *
+* that a multitude of sorts pays for spawning threads only once. The tasks are *
+* scheduled by work stealing: every worker keeps a deque of its own, to which  *
+* the tasks it submits are pushed, and the threads outside the pool share one  *
+* more deque. A thread takes its next task from the back of its own deque, so  *
+* that the tasks of a recursive sort run depth-first and on warm caches, and   *
+* once it runs dry steals the oldest, and thus largest, task from the front of *
+* the deque of another thread. A thread waiting for a group of tasks keeps     *
+* executing tasks in the same way, which is what allows the recursive          *
+* fork-join structure of the parallel sort to run on a fixed amount of threads *
+* without deadlocking.                                                         *
+*******************************************************************************/
+class ThreadPool {
+private:
+
+    struct task_deque {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // Tells the pool, if any, a thread is a worker of, and its index.
+    struct worker_identity {
+        const ThreadPool* p_pool;
+        size_t index;
+    };
+
+    // The deques of the workers, followed by the deque of the threads outside
+    // the pool.
+    std::vector<std::unique_ptr<task_deque>> m_deques;
+
+    // The amount of tasks in all the deques. The sleeping threads are woken
+    // up only after it has been incremented, so that no wake-up is lost.
+    std::atomic<size_t> m_queued;
+    std::atomic<size_t> m_next_index;
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    bool m_stop;
+
+#ifdef USE_POSIX_THREADS
+    std::vector<pthread_t> m_workers;
+#else
+    std::vector<std::thread> m_workers;
+#endif
+
+    static worker_identity& currentWorker()
+    {
+        static thread_local worker_identity identity = {nullptr, 0};
+        return identity;
+    }
+
+    /***************************************************************************
+    * Returns the index of the deque of the calling thread.                    *
+    ***************************************************************************/
+    size_t ownDeque() const
+    {
+        const worker_identity& identity = currentWorker();
+        return identity.p_pool == this ? identity.index : m_workers.size();
+    }
+
+    /***************************************************************************
+    * Takes a task from the back of the deque 'own', or failing that, steals   *
+    * one from the front of another deque. Returns false if all the deques are *
+    * empty.                                                                   *
+    ***************************************************************************/
+    bool tryTake(const size_t own, std::function<void()>& task)
+    {
+        {
+            task_deque& deque = *m_deques[own];
+            std::lock_guard<std::mutex> lock(deque.mutex);
+
+            if (!deque.tasks.empty())
+            {
+                task = std::move(deque.tasks.back());
+                deque.tasks.pop_back();
+                --m_queued;
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i != m_deques.size(); ++i)
+        {
+            if (m_queued.load() == 0)
+            {
+                return false;
+            }
+
+            task_deque& deque = *m_deques[(own + i) % m_deques.size()];
+            std::lock_guard<std::mutex> lock(deque.mutex);
+
+            if (!deque.tasks.empty())
+            {
+                task = std::move(deque.tasks.front());
+                deque.tasks.pop_front();
+                --m_queued;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /***************************************************************************
+    * Executes tasks until the pool is destroyed.                              *
+    ***************************************************************************/
+    void workerLoop()
+    {
+        const size_t index = m_next_index++;
+        currentWorker() = {this, index};
+
+        while (true)
+        {
+            std::function<void()> task;
+
+            if (tryTake(index, task))
+            {
+                task();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            while (!m_stop && m_queued.load() == 0)
+            {
+                m_condition.wait(lock);
+            }
+
+            if (m_queued.load() == 0)
+            {
+                // The pool is stopping and there is nothing left to do.
+                return;
+            }
+        }
+    }
+
+#ifdef USE_POSIX_THREADS
+    static void* workerThreadProxy(void* args)
+    {
+        ((ThreadPool*) args)->workerLoop();
+        return nullptr;
+    }
+#endif
+
+    /***************************************************************************
+    * Pins the workers to the NUMA nodes in consecutive blocks of about equal  *
+    * size. A worker may run on any CPU of its node.                           *
+    ***************************************************************************/
+    void spreadOverNumaNodes()
+    {
+#ifdef __linux__
+        const std::vector<std::vector<int>> nodes = numa_node_cpus();
+
+        if (nodes.size() < 2)
+        {
+            return;
+        }
+
+        for (size_t i = 0; i != m_workers.size(); ++i)
+        {
+            const std::vector<int>& cpus =
+                    nodes[i * nodes.size() / m_workers.size()];
+            cpu_set_t affinity;
+            CPU_ZERO(&affinity);
+
+            for (const int cpu : cpus)
+            {
+                CPU_SET(cpu, &affinity);
+            }
+
+#ifdef USE_POSIX_THREADS
+            pthread_setaffinity_np(m_workers[i], sizeof(affinity), &affinity);
+#else
+            pthread_setaffinity_np(m_workers[i].native_handle(),
+                                   sizeof(affinity),
+                                   &affinity);
+#endif
+        }
+#endif
+    }
+
+public:
+
+    /***************************************************************************
+    * Constructs a new pool with 'thread_amount' worker threads, by default    *
+    * one per available CPU. A pool always has at least one worker. If         *
+    * 'spread_over_numa_nodes' is true, the workers are pinned to the NUMA     *
+    * nodes of the system in blocks of about equal size, so that the memory    *
+    * they first touch stays on their nodes; it has no effect on a system with *
+    * a single node or where the nodes are unknown.                            *
+    ***************************************************************************/
+    explicit ThreadPool(size_t thread_amount = available_cpu_count(),
+                        const bool spread_over_numa_nodes = false) :
+    m_queued{0},
+    m_next_index{0},
+    m_stop{false}
+    {
+        thread_amount = std::max(thread_amount, (size_t) 1);
+
+        // The deques must all exist before the first worker looks into them.
+        for (size_t i = 0; i != thread_amount + 1; ++i)
+        {
+            m_deques.emplace_back(new task_deque);
+        }
+
+#ifdef USE_POSIX_THREADS
+        m_workers.resize(thread_amount);
+
+        for (size_t i = 0; i != thread_amount; ++i)
+        {
+            pthread_create(&m_workers[i],
+                           NULL,
+                           workerThreadProxy,
+                           (void*) this);
+        }
+#else
+        m_workers.reserve(thread_amount);
+
+        for (size_t i = 0; i != thread_amount; ++i)
+        {
+            m_workers.emplace_back(&ThreadPool::workerLoop, this);
+        }
+#endif
+
+        if (spread_over_numa_nodes)
+        {
+            spreadOverNumaNodes();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    /***************************************************************************
+    * Finishes all the pending tasks and joins the worker threads.             *
+    ***************************************************************************/
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+
+        m_condition.notify_all();
+
+        for (size_t i = 0; i != m_workers.size(); ++i)
+        {
+#ifdef USE_POSIX_THREADS
+            pthread_join(m_workers[i], NULL);
+#else
+            m_workers[i].join();
+#endif
+        }
+    }
+
+    /***************************************************************************
+    * Returns the amount of worker threads in this pool.                       *
+    ***************************************************************************/
+    size_t size() const
+    {
+        return m_workers.size();
+    }
+
+    /***************************************************************************
+    * Pushes the task to the back of the deque of the calling thread, from     *
+    * where the idle threads may steal it. The task must not throw; the tasks  *
+    * run through a 'TaskGroup' have their exceptions caught by the group.     *
+    ***************************************************************************/
+    void submit(std::function<void()> task)
+    {
+        {
+            task_deque& deque = *m_deques[ownDeque()];
+            std::lock_guard<std::mutex> lock(deque.mutex);
+            deque.tasks.push_back(std::move(task));
+            ++m_queued;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+
+        m_condition.notify_one();
+    }
+
+    /***************************************************************************
+    * Wakes up all the threads blocked in 'waitFor'. Must be called whenever a *
+    * counter some thread might be waiting on reaches zero.                    *
+    ***************************************************************************/
+    void notifyWaiters()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+
+        m_condition.notify_all();
+    }
+
+    /***************************************************************************
+    * Executes tasks of this pool until 'pending' reaches zero.                *
+    ***************************************************************************/
+    void waitFor(const std::atomic<size_t>& pending)
+    {
+        const size_t own = ownDeque();
+
+        while (pending.load() != 0)
+        {
+            std::function<void()> task;
+
+            if (tryTake(own, task))
+            {
+                task();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+
+            while (pending.load() != 0 && m_queued.load() == 0)
+            {
+                m_condition.wait(lock);
+            }
+        }
+    }
+};
+
+/*******************************************************************************
+* Runs a group of tasks and waits for all of them to complete. If the group is *
+* given a thread pool, the tasks are submitted to it. Otherwise, each task is  *
+* run in a thread of its own, which is spawned on 'run' and joined on 'wait'.  *
+* The first exception a task throws is kept and rethrown by 'wait' in the      *
+* waiting thread once all the tasks are complete.                              *
+*******************************************************************************/
+class TaskGroup {
+private:
+
+    ThreadPool* m_p_pool;
+    std::atomic<size_t> m_pending;
+    std::mutex m_exception_mutex;
+    std::exception_ptr m_exception;
+
+    // Used only when there is no pool. A deque never moves its elements, so
+    // the spawned threads may safely point to their tasks.
+    std::deque<std::function<void()>> m_thread_tasks;
+
+#ifdef USE_POSIX_THREADS
+    std::vector<pthread_t> m_threads;
+#else
+    std::vector<std::thread> m_threads;
+#endif
+
+    /***************************************************************************
+    * Runs the task, keeping the exception it throws if it is the first one.   *
+    ***************************************************************************/
+    void runGuarded(const std::function<void()>& task)
+    {
+        try
+        {
+            task();
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(m_exception_mutex);
+
+            if (!m_exception)
+            {
+                m_exception = std::current_exception();
+            }
+        }
+    }
+
+    /***************************************************************************
+    * Blocks until all the tasks of this group are complete.                   *
+    ***************************************************************************/
+    void join()
+    {
+        if (m_p_pool)
+        {
+            m_p_pool->waitFor(m_pending);
+            return;
+        }
+
+        for (size_t i = 0; i != m_threads.size(); ++i)
+        {
+#ifdef USE_POSIX_THREADS
+            pthread_join(m_threads[i], NULL);
+#else
+            m_threads[i].join();
+#endif
+        }
+
+        m_threads.clear();
+        m_thread_tasks.clear();
+    }
+
+public:
+
+    explicit TaskGroup(ThreadPool* p_pool) :
+    m_p_pool{p_pool},
+    m_pending{0}
+    {}
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    /***************************************************************************
+    * Waits for the tasks, but drops their exception, since the group is       *
+    * destroyed either after 'wait' or while another exception unwinds.        *
+    ***************************************************************************/
+    ~TaskGroup()
+    {
+        join();
+    }
+
+    /***************************************************************************
+    * Starts running the task concurrently with the calling thread.            *
+    ***************************************************************************/
+    void run(std::function<void()> task)
+    {
+        if (m_p_pool)
+        {
+            ThreadPool* p_pool = m_p_pool;
+            TaskGroup* p_group = this;
+            std::atomic<size_t>* p_pending = &m_pending;
+            ++m_pending;
+
+            p_pool->submit([p_pool, p_group, p_pending, task]()
+            {
+                p_group->runGuarded(task);
+
+                // The group may be gone as soon as the counter hits zero, so
+                // do not touch it afterwards.
+                if (--*p_pending == 0)
+                {
+                    p_pool->notifyWaiters();
+                }
+            });
+
+            return;
+        }
+
+        m_thread_tasks.push_back([this, task]()
+        {
+            runGuarded(task);
+        });
+
+#ifdef USE_POSIX_THREADS
+        pthread_t thread_;
+        pthread_create(&thread_,
+                       NULL,
+                       task_thread_proxy,
+                       (void*) &m_thread_tasks.back());
+        m_threads.push_back(thread_);
+#else
+        m_threads.emplace_back(m_thread_tasks.back());
+#endif
+    }
+
+    /***************************************************************************
+    * Blocks until all the tasks of this group are complete, and rethrows the  *
+    * first exception any of them threw.                                       *
+    ***************************************************************************/
+    void wait()
+    {
+        join();
+
+        if (m_exception)
+        {
+            std::exception_ptr exception = m_exception;
+            m_exception = nullptr;
+            std::rethrow_exception(exception);
+        }
+    }
+};
+
+/*******************************************************************************
+* Merges the piece of the output of merging the runs at 'first1' and 'first2'  *
+* that lies between the two diagonals of the merge path, at which the path     *
+* has taken 'left_begin' and 'left_end' elements of the first run.             *
+*******************************************************************************/
+template<class InputIt, class OutputIt, class Cmp>
+void merge_path_piece(InputIt first1,
+                      InputIt first2,
+                      OutputIt result,
+                      const size_t diagonal_begin,
+                      const size_t diagonal_end,
+                      const size_t left_begin,
+                      const size_t left_end,
+                      Cmp cmp)
+{
+    gallop_merge(first1 + left_begin,
+                 first1 + left_end,
+                 first2 + (diagonal_begin - left_begin),
+                 first2 + (diagonal_end - left_end),
+                 result + diagonal_begin,
+                 cmp);
+}
+
+/*******************************************************************************
+* Lists the diagonals of the merge path where the pieces of a parallel merge   *
+* begin and end, and where the raw part of its output begins and ends, along   *
+* with the amount of elements of the first run the path has taken at each of   *
+* them.                                                                        *
+*******************************************************************************/
+struct merge_path_cut {
+    size_t diagonal;
+    size_t left;
+};
+
+/*******************************************************************************
+* Works like 'merge_path_piece' for the piece between the cuts 'begin' and     *
+* 'end', but constructs the output elements between the cuts 'raw_begin' and   *
+* 'raw_end' of 'result', which are uninitialized storage, and assigns the      *
+* rest. If the comparator throws, the elements constructed are destroyed.      *
+*******************************************************************************/
+template<class InputIt, class OutputIt, class Cmp>
+void merge_path_piece_partially_raw(InputIt first1,
+                                    InputIt first2,
+                                    OutputIt result,
+                                    const merge_path_cut begin,
+                                    const merge_path_cut end,
+                                    const merge_path_cut raw_begin,
+                                    const merge_path_cut raw_end,
+                                    Cmp cmp)
+{
+    // Clamp the raw cuts to the piece.
+    const merge_path_cut raw_piece_begin =
+            raw_begin.diagonal <= begin.diagonal ? begin :
+            raw_begin.diagonal >= end.diagonal ? end : raw_begin;
+    const merge_path_cut raw_piece_end =
+            raw_end.diagonal <= raw_piece_begin.diagonal ? raw_piece_begin :
+            raw_end.diagonal >= end.diagonal ? end : raw_end;
+
+    raw_storage_guard<OutputIt> guard(result + raw_piece_begin.diagonal);
+
+    if (begin.diagonal != raw_piece_begin.diagonal)
+    {
+        merge_path_piece(first1,
+                         first2,
+                         result,
+                         begin.diagonal,
+                         raw_piece_begin.diagonal,
+                         begin.left,
+                         raw_piece_begin.left,
+                         cmp);
+    }
+
+    if (raw_piece_begin.diagonal != raw_piece_end.diagonal)
+    {
+        merge_path_piece(first1,
+                         first2,
+                         make_constructing_iterator(result,
+                                                    &guard.constructed()),
+                         raw_piece_begin.diagonal,
+                         raw_piece_end.diagonal,
+                         raw_piece_begin.left,
+                         raw_piece_end.left,
+                         cmp);
+    }
+
+    if (raw_piece_end.diagonal != end.diagonal)
+    {
+        merge_path_piece(first1,
+                         first2,
+                         result,
+                         raw_piece_end.diagonal,
+                         end.diagonal,
+                         raw_piece_end.left,
+                         end.left,
+                         cmp);
+    }
+
+    guard.release();
+}
+
+/*******************************************************************************
+* Merges the two adjacent sorted ranges [first, middle) and [middle, last)     *
+* into 'result' using 'thread_quota' threads. The output is cut into pieces of *
+* equal length, and both input ranges are split at the co-ranked positions of  *
+* each cut, so that every thread merges its own piece independently. The       *
+* calling thread merges the last piece. The elements are moved. The output     *
+* offsets [raw_begin, raw_end) are uninitialized storage and are constructed.  *
+* No piece is shorter than 'grain_size' elements. The time spent merging the   *
+* pieces is recorded into 'p_stats'.                                           *
+*                                                                              *
+* All the cuts are searched before any element is moved, since the searches    *
+* compare elements that another piece may already have moved from. If the      *
+* comparator throws, the raw part of the output is left raw.                   *
+*******************************************************************************/
+template<class InputIt, class OutputIt, class Cmp>
+void parallel_merge(InputIt first,
+                    InputIt middle,
+                    InputIt last,
+                    OutputIt result,
+                    const size_t raw_begin,
+                    const size_t raw_end,
+                    size_t thread_quota,
+                    const size_t grain_size,
+                    Cmp cmp,
+                    ThreadPool* p_pool,
+                    NaturalMergeSortStats* p_stats)
+{
+    typedef typename std::iterator_traits<InputIt>::value_type value_type;
+
+    const size_t length = std::distance(first, last);
+    const size_t length1 = std::distance(first, middle);
+    const size_t length2 = std::distance(middle, last);
+
+    // Do not bother running tiny pieces concurrently.
+    thread_quota = std::max((size_t) 1,
+                            std::min(thread_quota, length / grain_size));
+
+    auto cut_at = [&](const size_t diagonal)
+    {
+        merge_path_cut cut;
+        cut.diagonal = diagonal;
+        cut.left = merge_path_split(first,
+                                    length1,
+                                    middle,
+                                    length2,
+                                    diagonal,
+                                    cmp);
+        return cut;
+    };
+
+    const merge_path_cut raw_begin_cut = cut_at(std::min(raw_begin, length));
+    const merge_path_cut raw_end_cut = cut_at(std::min(raw_end, length));
+    std::vector<merge_path_cut> cuts(thread_quota + 1);
+
+    for (size_t i = 0; i <= thread_quota; ++i)
+    {
+        cuts[i] = cut_at(length * i / thread_quota);
+    }
+
+    // Tells which pieces are merged, for destroying their raw output if
+    // another piece throws.
+    std::vector<char> merged(thread_quota, 0);
+    char* p_merged = merged.data();
+    TaskGroup group(p_pool);
+
+    try
+    {
+        for (size_t i = 0; i + 1 < thread_quota; ++i)
+        {
+            const merge_path_cut piece_begin = cuts[i];
+            const merge_path_cut piece_end = cuts[i + 1];
+
+            group.run([=]()
+            {
+                const uint64_t start = stats_clock(p_stats);
+                merge_path_piece_partially_raw(first,
+                                               middle,
+                                               result,
+                                               piece_begin,
+                                               piece_end,
+                                               raw_begin_cut,
+                                               raw_end_cut,
+                                               cmp);
+                stats_record_thread_time(
+                        p_stats,
+                        &NaturalMergeSortStats::ThreadTimes::merge_nanoseconds,
+                        start);
+                p_merged[i] = 1;
+            });
+        }
+
+        const uint64_t start = stats_clock(p_stats);
+        merge_path_piece_partially_raw(first,
+                                       middle,
+                                       result,
+                                       cuts[thread_quota - 1],
+                                       cuts[thread_quota],
+                                       raw_begin_cut,
+                                       raw_end_cut,
+                                       cmp);
+        stats_record_thread_time(
+                p_stats,
+                &NaturalMergeSortStats::ThreadTimes::merge_nanoseconds,
+                start);
+        p_merged[thread_quota - 1] = 1;
+        group.wait();
+    }
+    catch (...)
+    {
+        // Only one exception is rethrown, so the ones of the other pieces
+        // are dropped.
+        try
+        {
+            group.wait();
+        }
+        catch (...) {}
+
+        for (size_t i = 0; i != thread_quota; ++i)
+        {
+            const size_t raw_piece_begin =
+                    std::max(cuts[i].diagonal, raw_begin_cut.diagonal);
+            const size_t raw_piece_end =
+                    std::min(cuts[i + 1].diagonal, raw_end_cut.diagonal);
+
+            if (merged[i] && raw_piece_begin < raw_piece_end)
+            {
+                destroy_range<value_type>(&*(result + raw_piece_begin),
+                                          &*(result + raw_piece_end));
+            }
+        }
+
+        throw;
+    }
+
+    stats_record_moves(p_stats, 0, length * sizeof(value_type));
+}
+
+/*******************************************************************************
+* Collects the runs of a single chunk scanned by 'parallel_scan_runs'. Every   *
+* descending run except the first and the last one is reversed right away.     *
+* The two outermost runs may still be stitched together with the runs of the   *
+* neighbouring chunks, so their reversal is deferred.                          *
+*******************************************************************************/
+template<class RandomIt>
+struct chunk_run_collector {
+    std::vector<size_t> run_lengths;
+    bool first_descending;
+    bool last_descending;
+    RandomIt last_head;
+    RandomIt last_tail;
+
+    void operator()(RandomIt head, RandomIt tail, const bool descending)
+    {
+        if (run_lengths.empty())
+        {
+            first_descending = descending;
+        }
+        else if (run_lengths.size() > 1 && last_descending)
+        {
+            // The previous run is neither the first nor the last one.
+            std::reverse(last_head, last_tail);
+        }
+
+        run_lengths.push_back(tail - head);
+        last_descending = descending;
+        last_head = head;
+        last_tail = tail;
+    }
+};
+
+/*******************************************************************************
+* Reverses the ranges [first + offset, first + offset + length) given as the   *
+* ('offset', 'length') pairs in 'runs' using 'thread_quota' threads. A long    *
+* range is reversed by several threads, each swapping its own share of at      *
+* least 'grain_size' element pairs.                                            *
+*******************************************************************************/
+template<class RandomIt>
+void parallel_reverse_runs(RandomIt first,
+                           const std::vector<std::pair<size_t, size_t>>& runs,
+                           const size_t thread_quota,
+                           const size_t grain_size,
+                           ThreadPool* p_pool)
+{
+    TaskGroup group(p_pool);
+
+    for (size_t i = 0; i != runs.size(); ++i)
+    {
+        const RandomIt head = first + runs[i].first;
+        const RandomIt tail = head + runs[i].second;
+        const size_t swaps = runs[i].second / 2;
+        const size_t pieces = std::min(thread_quota, swaps / grain_size);
+
+        if (pieces < 2)
+        {
+            std::reverse(head, tail);
+            continue;
+        }
+
+        for (size_t piece = 0; piece != pieces; ++piece)
+        {
+            const size_t piece_begin = swaps * piece / pieces;
+            const size_t piece_end = swaps * (piece + 1) / pieces;
+
+            group.run([=]()
+            {
+                std::swap_ranges(head + piece_begin,
+                                 head + piece_end,
+                                 std::reverse_iterator<RandomIt>(tail - piece_begin));
+            });
+        }
+    }
+
+    group.wait();
+}
+
+/*******************************************************************************
+* Scans the runs of the range [first, first + length) in parallel and returns  *
+* their lengths in the order they appear in the range. The range is cut into   *
+* 'thread_quota' chunks, whose runs are scanned concurrently. After that, each *
+* run touching a chunk boundary is stitched together with the run on the other *
+* side of the boundary whenever the two continue each other in the same        *
+* direction. A run of a single element may continue a run in either direction. *
+* Finally, the descending runs that touch the chunk boundaries are reversed in *
+* parallel. Two strictly descending runs are joined only across a strictly     *
+* descending pair, so the sort remains stable.                                 *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+std::vector<size_t> parallel_scan_runs(RandomIt first,
+                                       const size_t length,
+                                       size_t thread_quota,
+                                       const size_t grain_size,
+                                       Cmp cmp,
+                                       ThreadPool* p_pool)
+{
+    const size_t chunk_amount =
+            std::max((size_t) 1,
+                     std::min(thread_quota, length / grain_size));
+
+    std::vector<chunk_run_collector<RandomIt>> chunks(chunk_amount);
+
+    {
+        TaskGroup group(p_pool);
+
+        for (size_t i = 0; i != chunk_amount; ++i)
+        {
+            const RandomIt chunk_begin = first + length * i / chunk_amount;
+            const RandomIt chunk_end = first + length * (i + 1) / chunk_amount;
+            chunk_run_collector<RandomIt>* p_chunk = &chunks[i];
+
+            if (i == chunk_amount - 1)
+            {
+                scan_runs(chunk_begin, chunk_end, cmp, *p_chunk);
+                break;
+            }
+
+            group.run([=]()
+            {
+                scan_runs(chunk_begin, chunk_end, cmp, *p_chunk);
+            });
+        }
+
+        group.wait();
+    }
+
+    std::vector<size_t> run_lengths;
+    std::vector<std::pair<size_t, size_t>> reversals;
+
+    // The last run seen so far, which may still grow into the next chunk.
+    size_t run_offset = 0;
+    size_t run_length = 0;
+    bool run_descending = false;
+
+    for (size_t i = 0; i != chunk_amount; ++i)
+    {
+        const size_t chunk_begin = length * i / chunk_amount;
+        const std::vector<size_t>& chunk_runs = chunks[i].run_lengths;
+        const size_t last_index = chunk_runs.size() - 1;
+        size_t offset = chunk_begin;
+
+        for (size_t j = 0; j <= last_index; ++j)
+        {
+            const size_t current_length = chunk_runs[j];
+
+            // The inner descending runs are already reversed.
+            const bool descending = j == 0 ? chunks[i].first_descending :
+                                    j == last_index ? chunks[i].last_descending :
+                                                      false;
+
+            if (j == 0 && run_length > 0)
+            {
+                const bool descends = cmp(*(first + chunk_begin),
+                                          *(first + (chunk_begin - 1)));
+
+                if ((run_length == 1 || run_descending == descends) &&
+                    (current_length == 1 || descending == descends))
+                {
+                    run_length += current_length;
+                    run_descending = descends;
+                    offset += current_length;
+                    continue;
+                }
+            }
+
+            if (run_length > 0)
+            {
+                run_lengths.push_back(run_length);
+
+                if (run_descending)
+                {
+                    reversals.push_back(std::make_pair(run_offset, run_length));
+                }
+            }
+
+            run_offset = offset;
+            run_length = current_length;
+            run_descending = descending;
+            offset += current_length;
+        }
+    }
+
+    run_lengths.push_back(run_length);
+
+    if (run_descending)
+    {
+        reversals.push_back(std::make_pair(run_offset, run_length));
+    }
+
+    parallel_reverse_runs(first, reversals, thread_quota, grain_size, p_pool);
+    return run_lengths;
+}
+
+/*******************************************************************************
+* Computes the chunk boundaries for sorting a range of 'length' elements with  *
+* 'chunk_amount' threads. The offset of the first chunk boundary is zero, and  *
+* the last one is 'length'. The chunks are of equal length.                    *
+*******************************************************************************/
+inline std::vector<size_t> compute_chunk_cuts(const size_t length,
+                                              const size_t chunk_amount)
+{
+    std::vector<size_t> cuts(chunk_amount + 1);
+
+    for (size_t i = 0; i <= chunk_amount; ++i)
+    {
+        cuts[i] = length * i / chunk_amount;
+    }
+
+    return cuts;
+}
+
+/*******************************************************************************
+* Computes the chunk boundaries for sorting a range of 'length' elements with  *
+* 'chunk_amount' threads so that no run gets split. 'run_lengths' lists the    *
+* run lengths of the range in order. Every cut is put at the run boundary      *
+* nearest to where it would be when cutting the range into chunks of equal     *
+* length, and cuts that end up in the same place are dropped. Stores the index *
+* of the first run of each chunk to 'run_cuts', the last entry of which is the *
+* amount of runs.                                                              *
+*******************************************************************************/
+inline std::vector<size_t>
+compute_run_aware_chunk_cuts(const std::vector<size_t>& run_lengths,
+                             const size_t length,
+                             const size_t chunk_amount,
+                             std::vector<size_t>& run_cuts)
+{
+    std::vector<size_t> cuts(1, 0);
+    run_cuts.assign(1, 0);
+
+    size_t previous_boundary = 0;
+    size_t boundary = 0;
+    size_t next_cut = 1;
+
+    for (size_t i = 0; i + 1 < run_lengths.size() && next_cut < chunk_amount;
+         ++i)
+    {
+        boundary += run_lengths[i];
+
+        while (next_cut < chunk_amount &&
+               length * next_cut / chunk_amount <= boundary)
+        {
+            const size_t ideal = length * next_cut / chunk_amount;
+            ++next_cut;
+
+            // The boundaries around the ideal cut are 'previous_boundary' at
+            // the start of the run 'i' and 'boundary' at its end.
+            size_t cut = boundary;
+            size_t run_cut = i + 1;
+
+            if (ideal - previous_boundary < boundary - ideal)
+            {
+                cut = previous_boundary;
+                run_cut = i;
+            }
+
+            if (cut > cuts.back())
+            {
+                cuts.push_back(cut);
+                run_cuts.push_back(run_cut);
+            }
+        }
+
+        previous_boundary = boundary;
+    }
+
+    cuts.push_back(length);
+    run_cuts.push_back(run_lengths.size());
+    return cuts;
+}
+
+/*******************************************************************************
+* Writes a byte to every page of the contiguous storage [first, last), so      *
+* that the pages not yet backed by memory get it from the NUMA node of the     *
+* calling thread. The storage must not hold elements that are still needed.    *
+*******************************************************************************/
+template<class RandomIt>
+void first_touch_pages(RandomIt first, RandomIt last, std::true_type)
+{
+    if (first == last)
+    {
+        return;
+    }
+
+    volatile char* const begin = (volatile char*) &*first;
+    volatile char* const end = (volatile char*) (&*(last - 1) + 1);
+
+    for (volatile char* p = begin; p < end; p += FIRST_TOUCH_STRIDE)
+    {
+        *p = 0;
+    }
+
+    *(end - 1) = 0;
+}
+
+/*******************************************************************************
+* Does nothing, as the storage of the iterators may not be contiguous.         *
+*******************************************************************************/
+template<class RandomIt>
+void first_touch_pages(RandomIt, RandomIt, std::false_type) {}
+
+/*******************************************************************************
+* Holds the state shared by all the recursive calls of one parallel sort. If   *
+* 'raw_buffer' is true, the scratch buffer is uninitialized storage whose      *
+* elements are constructed when they are written for the first time.           *
+*******************************************************************************/
+template<class Cmp>
+struct parallel_sort_context {
+    Cmp cmp;
+    ThreadPool* p_pool;
+    const size_t* p_run_lengths;
+    const NaturalMergeSortOptions* p_options;
+    sort_monitor* p_monitor;
+    size_t grain_size;
+    size_t tasks_per_thread;
+    bool raw_buffer;
+
+    explicit parallel_sort_context(Cmp cmp) : cmp(cmp) {}
+};
+
+/*******************************************************************************
+* Implements parallel merge sort. The chunks delimited by the offsets          *
+* 'p_cuts[0]', ..., 'p_cuts[chunk_amount]' are split in two halves, each of    *
+* which is sorted recursively, after which all the 'thread_quota' threads of   *
+* this subtree merge the halves. Every chunk is sorted by a single thread.     *
+* The quota is shared between the halves in proportion to their lengths. If    *
+* the context has a thread pool, all the work is done in its threads.          *
+*                                                                              *
+* On entry, the data is in 'source' if 'copy_to_target' is true, and in        *
+* 'target' otherwise; the sorted data ends up in 'target'. If 'p_run_cuts' is  *
+* not null, the chunk 'i' consists of the already scanned runs                 *
+* 'p_run_lengths[p_run_cuts[i]]', ..., 'p_run_lengths[p_run_cuts[i + 1] - 1]'. *
+*                                                                              *
+* Returns true if the scratch buffer is constructed over the range of this     *
+* subtree. It may remain raw only over a chunk that is sorted in the input     *
+* without ever writing to the buffer. If the comparator throws, the buffer is  *
+* left raw over the range of this subtree.                                     *
+*******************************************************************************/
+template<class SourceIt, class TargetIt, class Cmp>
+bool parallel_natural_merge_sort_impl(SourceIt source, 
+                                      TargetIt target, 
+                                      const size_t* p_cuts,
+                                      const size_t* p_run_cuts,
+                                      const size_t chunk_amount,
+                                      const bool copy_to_target,
+                                      const size_t thread_quota,
+                                      const parallel_sort_context<Cmp>* p_context)
+{
+    const size_t begin = p_cuts[0];
+    const size_t end = p_cuts[chunk_amount];
+
+    if (chunk_amount == 1)
+    {
+        typedef typename std::iterator_traits<SourceIt>::value_type value_type;
+        const uint64_t start = stats_clock(p_context->p_options->p_stats);
+
+        // If the data is to be moved, the target is the buffer, and the
+        // source is the input.
+        const bool scratch_is_raw = p_context->raw_buffer && !copy_to_target;
+
+        // Otherwise, the source is the buffer, which the sort might not write
+        // to at all, so its pages are touched explicitly.
+        if (p_context->p_options->numa_first_touch && !copy_to_target &&
+            (p_context->raw_buffer || std::is_trivial<value_type>::value))
+        {
+            first_touch_pages(source + begin,
+                              source + end,
+                              is_contiguous_iterator<SourceIt, value_type>());
+        }
+
+        raw_storage_guard<TargetIt> guard(target + begin);
+
+        if (copy_to_target)
+        {
+            if (p_context->raw_buffer)
+            {
+                std::move(source + begin,
+                          source + end,
+                          make_constructing_iterator(target + begin,
+                                                     &guard.constructed()));
+            }
+            else
+            {
+                std::move(source + begin, source + end, target + begin);
+            }
+        }
+
+        bool scratch_constructed = false;
+
+        if (p_context->p_monitor->cancelled())
+        {
+            // Leave the chunk unsorted.
+        }
+        else if (!p_run_cuts)
+        {
+            scratch_constructed =
+                natural_merge_sort_impl(target + begin,
+                                        target + end,
+                                        source + begin,
+                                        p_context->cmp,
+                                        scratch_is_raw,
+                                        *p_context->p_options);
+        }
+        else
+        {
+            UnsafeIntQueue<> queue(p_run_cuts[1] - p_run_cuts[0]);
+
+            for (size_t i = p_run_cuts[0]; i != p_run_cuts[1]; ++i)
+            {
+                queue.enqueue(p_context->p_run_lengths[i]);
+            }
+
+            scratch_constructed =
+                sort_runs(target + begin,
+                          target + end,
+                          source + begin,
+                          &queue,
+                          p_context->cmp,
+                          scratch_is_raw,
+                          *p_context->p_options);
+        }
+
+        stats_record_thread_time(
+                p_context->p_options->p_stats,
+                &NaturalMergeSortStats::ThreadTimes::chunk_nanoseconds,
+                start);
+        p_context->p_monitor->advance();
+
+        guard.release();
+        return !scratch_is_raw || scratch_constructed;
+    }
+
+    const size_t left_chunk_amount = chunk_amount / 2;
+    const size_t middle = p_cuts[left_chunk_amount];
+
+    size_t left_quota = (size_t)((double) thread_quota * (middle - begin)
+                                 / (end - begin) + 0.5);
+    left_quota = std::max((size_t) 1,
+                          std::min(left_quota, thread_quota - 1));
+    const size_t right_quota = std::max((size_t) 1, thread_quota - left_quota);
+
+    TaskGroup group(p_context->p_pool);
+    bool left_constructed = false;
+    bool right_constructed = false;
+
+    try
+    {
+        group.run([=, &left_constructed]()
+        {
+            left_constructed = parallel_natural_merge_sort_impl(target,
+                                             source,
+                                             p_cuts,
+                                             p_run_cuts,
+                                             left_chunk_amount,
+                                             !copy_to_target,
+                                             left_quota,
+                                             p_context);
+        });
+
+        right_constructed =
+            parallel_natural_merge_sort_impl(target,
+                                             source,
+                                             p_cuts + left_chunk_amount,
+                                             p_run_cuts ?
+                                                p_run_cuts + left_chunk_amount :
+                                                nullptr,
+                                             chunk_amount - left_chunk_amount,
+                                             !copy_to_target,
+                                             right_quota,
+                                             p_context);
+        // Wait for the left subtree.
+        group.wait();
+
+        // When merging into the buffer, the halves whose buffer was never
+        // written to are still raw. Either half, both or neither may be raw,
+        // so the raw part of the output is a single range.
+        size_t raw_begin = 0;
+        size_t raw_end = 0;
+
+        if (copy_to_target && p_context->raw_buffer)
+        {
+            raw_begin = left_constructed ? middle - begin : 0;
+            raw_end = right_constructed ? middle - begin : end - begin;
+        }
+
+        if (p_context->p_monitor->cancelled())
+        {
+            // Move the halves to the target without merging them.
+            std::move(source + begin,
+                      source + begin + raw_begin,
+                      target + begin);
+            std::move(source + begin + raw_begin,
+                      source + begin + raw_end,
+                      make_constructing_iterator(target + begin + raw_begin));
+            std::move(source + begin + raw_end,
+                      source + end,
+                      target + begin + raw_end);
+            return true;
+        }
+
+        // Merge the two chunks using all the threads of this subtree.
+        parallel_merge(source + begin,
+                       source + middle,
+                       source + end,
+                       target + begin,
+                       raw_begin,
+                       raw_end,
+                       thread_quota * p_context->tasks_per_thread,
+                       p_context->grain_size,
+                       p_context->cmp,
+                       p_context->p_pool,
+                       p_context->p_options->p_stats);
+        p_context->p_monitor->advance();
+    }
+    catch (...)
+    {
+        // A subtree or a merge that throws leaves its raw part of the buffer
+        // raw, so only the halves the subtrees constructed are destroyed,
+        // once both subtrees are done. The buffer is the target when the
+        // data is moved, and the source otherwise.
+        try
+        {
+            group.wait();
+        }
+        catch (...) {}
+
+        if (p_context->raw_buffer)
+        {
+            typedef typename std::iterator_traits<SourceIt>::value_type
+                    value_type;
+            value_type* const buffer = copy_to_target ? &*target : &*source;
+
+            if (left_constructed)
+            {
+                destroy_range(buffer + begin, buffer + middle);
+            }
+
+            if (right_constructed)
+            {
+                destroy_range(buffer + middle, buffer + end);
+            }
+        }
+
+        throw;
+    }
+
+    return true;
+}
+
+/*******************************************************************************
+* Calls 'function(piece_begin, piece_end)' concurrently for 'thread_quota'     *
+* consecutive pieces of equal length covering [0, length), but for no piece    *
+* shorter than 'grain_size' unless the range is.                               *
+*******************************************************************************/
+template<class Function>
+void parallel_for_pieces(const size_t length,
+                         size_t thread_quota,
+                         const size_t grain_size,
+                         ThreadPool* p_pool,
+                         Function function)
+{
+    thread_quota = std::max((size_t) 1,
+                            std::min(thread_quota, length / grain_size));
+
+    TaskGroup group(p_pool);
+
+    for (size_t i = 0; i != thread_quota - 1; ++i)
+    {
+        const size_t piece_begin = length * i / thread_quota;
+        const size_t piece_end = length * (i + 1) / thread_quota;
+
+        group.run([=]()
+        {
+            function(piece_begin, piece_end);
+        });
+    }
+
+    function(length * (thread_quota - 1) / thread_quota, length);
+    group.wait();
+}
+
+/*******************************************************************************
+* Returns the amount of scratch elements 'parallel_natural_merge_sort' needs   *
+* for sorting a range of 'length' elements.                                    *
+*******************************************************************************/
+inline size_t parallel_natural_merge_sort_scratch_size(const size_t length)
+{
+    return length;
+}
+
+/*******************************************************************************
+* Works like 'merge_adjacent_runs_bounded', but with 'thread_quota' threads:   *
+* the two merges left by the rotation run concurrently, each with a share of   *
+* the threads and of the buffer proportional to its length. Every merge        *
+* destroys the elements it constructs in a raw buffer before it returns, also  *
+* when the comparator throws.                                                  *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+void parallel_merge_adjacent_runs_bounded(RandomIt first,
+                                          RandomIt middle,
+                                          RandomIt last,
+                                          BufferIt buffer,
+                                          const size_t buffer_size,
+                                          const bool buffer_is_raw,
+                                          const size_t thread_quota,
+                                          const size_t grain_size,
+                                          Cmp cmp,
+                                          ThreadPool* p_pool)
+{
+    const size_t left_length = std::distance(first, middle);
+    const size_t right_length = std::distance(middle, last);
+    const size_t length = left_length + right_length;
+
+    if (thread_quota < 2 || length < 2 * grain_size ||
+        left_length == 0 || right_length == 0)
+    {
+        raw_storage_guard<BufferIt> guard(buffer);
+        merge_adjacent_runs_bounded(first,
+                                    middle,
+                                    last,
+                                    buffer,
+                                    buffer_size,
+                                    cmp,
+                                    buffer_is_raw,
+                                    guard.constructed());
+        return;
+    }
+
+    RandomIt left_cut;
+    RandomIt right_cut;
+
+    if (left_length >= right_length)
+    {
+        left_cut = first + left_length / 2;
+        right_cut = std::lower_bound(middle, last, *left_cut, cmp);
+    }
+    else
+    {
+        right_cut = middle + right_length / 2;
+        left_cut = std::upper_bound(first, middle, *right_cut, cmp);
+    }
+
+    const RandomIt new_middle = std::rotate(left_cut, middle, right_cut);
+    const size_t new_left_length = std::distance(first, new_middle);
+
+    size_t left_quota = (size_t)((double) thread_quota * new_left_length
+                                 / length + 0.5);
+    left_quota = std::max((size_t) 1,
+                          std::min(left_quota, thread_quota - 1));
+    const size_t left_buffer_size = buffer_size * left_quota / thread_quota;
+
+    TaskGroup group(p_pool);
+
+    group.run([=]()
+    {
+        parallel_merge_adjacent_runs_bounded(first,
+                                             left_cut,
+                                             new_middle,
+                                             buffer,
+                                             left_buffer_size,
+                                             buffer_is_raw,
+                                             left_quota,
+                                             grain_size,
+                                             cmp,
+                                             p_pool);
+    });
+
+    parallel_merge_adjacent_runs_bounded(new_middle,
+                                         right_cut,
+                                         last,
+                                         buffer + left_buffer_size,
+                                         buffer_size - left_buffer_size,
+                                         buffer_is_raw,
+                                         thread_quota - left_quota,
+                                         grain_size,
+                                         cmp,
+                                         p_pool);
+    group.wait();
+}
+
+/*******************************************************************************
+* Sorts the chunks delimited by the offsets 'p_cuts[0]', ...,                  *
+* 'p_cuts[chunk_amount]' of the range starting at 'first' in parallel with one *
+* thread per chunk, using at most 'buffer_size' elements of 'buffer'. Every    *
+* chunk is sorted in place with its share of the buffer by                     *
+* 'bounded_natural_merge_sort', after which the halves are merged in place by  *
+* all the threads of the subtree.                                              *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+void parallel_bounded_natural_merge_sort_impl(
+        RandomIt first,
+        const size_t* p_cuts,
+        const size_t chunk_amount,
+        BufferIt buffer,
+        const size_t buffer_size,
+        const bool buffer_is_raw,
+        const size_t grain_size,
+        Cmp cmp,
+        const NaturalMergeSortOptions* p_options)
+{
+    if (chunk_amount == 1)
+    {
+        bounded_natural_merge_sort(first + p_cuts[0],
+                                   first + p_cuts[1],
+                                   buffer,
+                                   buffer_size,
+                                   cmp,
+                                   buffer_is_raw,
+                                   *p_options);
+        return;
+    }
+
+    const size_t left_chunk_amount = chunk_amount / 2;
+    const size_t left_buffer_size =
+            buffer_size * left_chunk_amount / chunk_amount;
+
+    TaskGroup group(p_options->p_pool);
+
+    group.run([=]()
+    {
+        parallel_bounded_natural_merge_sort_impl(first,
+                                                 p_cuts,
+                                                 left_chunk_amount,
+                                                 buffer,
+                                                 left_buffer_size,
+                                                 buffer_is_raw,
+                                                 grain_size,
+                                                 cmp,
+                                                 p_options);
+    });
+
+    parallel_bounded_natural_merge_sort_impl(first,
+                                             p_cuts + left_chunk_amount,
+                                             chunk_amount - left_chunk_amount,
+                                             buffer + left_buffer_size,
+                                             buffer_size - left_buffer_size,
+                                             buffer_is_raw,
+                                             grain_size,
+                                             cmp,
+                                             p_options);
+    group.wait();
+
+    parallel_merge_adjacent_runs_bounded(first + p_cuts[0],
+                                         first + p_cuts[left_chunk_amount],
+                                         first + p_cuts[chunk_amount],
+                                         buffer,
+                                         buffer_size,
+                                         buffer_is_raw,
+                                         chunk_amount,
+                                         grain_size,
+                                         cmp,
+                                         p_options->p_pool);
+}
+
+/*******************************************************************************
+* Returns the amount of threads a parallel sort may use as specified by        *
+* 'options'. When running in a pool, the calling thread takes part in          *
+* sorting, and an explicit thread count cannot exceed the threads of the pool. *
+*******************************************************************************/
+inline size_t resolve_thread_count(const NaturalMergeSortOptions& options)
+{
+    if (options.p_pool)
+    {
+        const size_t pool_threads = options.p_pool->size() + 1;
+
+        return options.thread_count == 0 ?
+               pool_threads : std::min(options.thread_count, pool_threads);
+    }
+
+    return options.thread_count == 0 ? available_cpu_count() :
+                                       options.thread_count;
+}
+
+/*******************************************************************************
+* Sorts the range [begin, end) in parallel using 'buffer' as the scratch       *
+* buffer. If 'raw_buffer' is true, the buffer is uninitialized storage: its    *
+* elements are move-constructed when they are written for the first time and   *
+* destroyed afterwards.                                                        *
+*                                                                              *
+* The range is split into 'tasks_per_thread' chunks per thread, but never into *
+* chunks shorter than the grain size of 'options'. The chunks are sorted       *
+* concurrently, after which they are merged pairwise until only one chunk      *
+* remains. Without a pool in 'options', the sort runs in a pool of its own for *
+* the duration of the call, so that the threads steal the chunks and the       *
+* pieces of the merges from each other either way. With the run-aware          *
+* partitioning, the runs of the entire range are scanned in parallel first,    *
+* and the chunks are cut along the run boundaries. The chunks then merge their *
+* runs without scanning them again, so that a presorted range takes one        *
+* parallel scan and a few merges.                                              *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+void parallel_natural_merge_sort_with_buffer(
+        RandomIt begin,
+        RandomIt end,
+        BufferIt buffer,
+        const bool raw_buffer,
+        Cmp cmp,
+        const NaturalMergeSortOptions& options)
+{
+    const size_t length = std::distance(begin, end);
+
+    if (length < 2)
+    {
+        // Trivially sorted.
+        return;
+    }
+
+#ifdef NATURAL_MERGE_SORT_STATS
+    if (counts_comparisons<Cmp>(options))
+    {
+        parallel_natural_merge_sort_with_buffer(
+                begin,
+                end,
+                buffer,
+                raw_buffer,
+                make_counting_comparator(cmp, options.p_stats),
+                options);
+        return;
+    }
+#endif
+
+    // A range too short for two threads is sorted on the calling thread
+    // without looking the CPUs up.
+    const size_t grain_size = std::max(options.grain_size, (size_t) 1);
+    const size_t spawn = length / grain_size < 2 ? 1 :
+                         std::max((size_t) 1,
+                                  std::min(resolve_thread_count(options),
+                                           length / grain_size));
+
+    if (spawn > 1 && !options.p_pool)
+    {
+        // The calling thread is the last one.
+        ThreadPool pool(spawn - 1, options.numa_first_touch);
+        NaturalMergeSortOptions pooled_options = options;
+        pooled_options.p_pool = &pool;
+        parallel_natural_merge_sort_with_buffer(begin,
+                                                end,
+                                                buffer,
+                                                raw_buffer,
+                                                cmp,
+                                                pooled_options);
+        return;
+    }
+
+    const size_t tasks_per_thread =
+            std::max(options.tasks_per_thread, (size_t) 1);
+    const size_t chunk_amount = spawn == 1 ? 1 :
+                                std::min(spawn * tasks_per_thread,
+                                         length / grain_size);
+    const uint64_t stats_start = stats_begin_parallel_sort(options.p_stats);
+
+    if (options.scratch_budget <
+        parallel_natural_merge_sort_scratch_size(length))
+    {
+        const std::vector<size_t> cuts = compute_chunk_cuts(length, spawn);
+        parallel_bounded_natural_merge_sort_impl(begin,
+                                                 cuts.data(),
+                                                 cuts.size() - 1,
+                                                 buffer,
+                                                 options.scratch_budget,
+                                                 raw_buffer,
+                                                 grain_size,
+                                                 cmp,
+                                                 &options);
+        stats_end_parallel_sort(options.p_stats, stats_start);
+        return;
+    }
+
+    std::vector<size_t> run_lengths;
+    std::vector<size_t> run_cuts;
+    std::vector<size_t> cuts;
+
+    // A range whose sampled runs are long is presorted enough to be worth
+    // cutting along its run boundaries.
+    const bool run_aware =
+            options.run_aware_partitioning ||
+            (options.presortedness_probe &&
+             length >= PROBE_MINIMUM_LENGTH &&
+             probe_mean_run_length(begin, begin + length, cmp) >=
+                PROBE_LONG_RUN_LENGTH);
+
+    if (run_aware)
+    {
+        run_lengths = parallel_scan_runs(begin,
+                                         length,
+                                         spawn,
+                                         grain_size,
+                                         cmp,
+                                         options.p_pool);
+
+        if (run_lengths.size() == 1)
+        {
+            // Already sorted.
+            stats_record_runs(options.p_stats, run_lengths);
+            stats_end_parallel_sort(options.p_stats, stats_start);
+            return;
+        }
+
+        cuts = compute_run_aware_chunk_cuts(run_lengths,
+                                            length,
+                                            chunk_amount,
+                                            run_cuts);
+    }
+    else
+    {
+        cuts = compute_chunk_cuts(length, chunk_amount);
+    }
+
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    // The chunks report the progress of the whole sort instead of their own.
+    NaturalMergeSortOptions chunk_options = options;
+    chunk_options.p_progress = nullptr;
+    sort_monitor monitor(options, 2 * (cuts.size() - 1) - 1);
+
+    parallel_sort_context<Cmp> context(cmp);
+    context.p_pool = options.p_pool;
+    context.p_run_lengths = run_lengths.data();
+    context.p_options = &chunk_options;
+    context.p_monitor = &monitor;
+    context.grain_size = grain_size;
+    context.tasks_per_thread = tasks_per_thread;
+    context.raw_buffer = raw_buffer;
+
+    const bool buffer_constructed =
+        parallel_natural_merge_sort_impl(buffer,
+                                         begin,
+                                         cuts.data(),
+                                         run_aware ? run_cuts.data() : nullptr,
+                                         cuts.size() - 1,
+                                         false,
+                                         spawn,
+                                         &context);
+
+    if (raw_buffer && buffer_constructed)
+    {
+        parallel_for_pieces(length,
+                            spawn,
+                            grain_size,
+                            options.p_pool,
+                            [=](size_t piece_begin, size_t piece_end)
+        {
+            destroy_range<value_type>(&*(buffer + piece_begin),
+                                      &*(buffer + piece_end));
+        });
+    }
+
+    stats_end_parallel_sort(options.p_stats, stats_start);
+}
+
+/*******************************************************************************
+* Sorts the range [begin, end) in parallel as specified by 'options' using the *
+* caller-supplied 'buffer', which must point to at least                       *
+* 'parallel_natural_merge_sort_scratch_size(end - begin)' constructed          *
+* elements. The contents of the buffer are overwritten.                        *
+*******************************************************************************/
+template<class RandomIt, class BufferIt, class Cmp>
+void parallel_natural_merge_sort(RandomIt begin,
+                                 RandomIt end,
+                                 BufferIt buffer,
+                                 Cmp cmp,
+                                 const NaturalMergeSortOptions& options)
+{
+    parallel_natural_merge_sort_with_buffer(begin,
+                                            end,
+                                            buffer,
+                                            false,
+                                            cmp,
+                                            options);
+}
+
+/*******************************************************************************
+* Sorts the range [begin, end) in parallel as specified by 'options' using the *
+* storage of 'scratch', which is grown when it is too small for the range.     *
+*******************************************************************************/
+template<class RandomIt, class Cmp, class T, class Alloc>
+void parallel_natural_merge_sort(RandomIt begin,
+                                 RandomIt end,
+                                 Cmp cmp,
+                                 ScratchBuffer<T, Alloc>& scratch,
+                                 const NaturalMergeSortOptions& options)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    static_assert(std::is_same<T, value_type>::value,
+                  "The scratch buffer must hold elements of the sorted type.");
+
+    scratch.reserve(std::min(options.scratch_budget,
+                             parallel_natural_merge_sort_scratch_size(
+                             std::distance(begin, end))));
+
+    parallel_natural_merge_sort_with_buffer(
+            begin,
+            end,
+            scratch.data(),
+            storage_needs_construction<T>::value,
+            cmp,
+            options);
+}
+
+/*******************************************************************************
+* Sorts the range [begin, end) in parallel as specified by 'options'.          *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+void parallel_natural_merge_sort(RandomIt begin,
+                                 RandomIt end,
+                                 Cmp cmp,
+                                 const NaturalMergeSortOptions& options)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    ScratchBuffer<value_type> scratch;
+    parallel_natural_merge_sort(begin, end, cmp, scratch, options);
+}
+
+/*******************************************************************************
+* The actual parallel merge sort. If the process may run on N CPUs, this sort  *
+* will split the range into a few chunks of equal length per each of N         *
+* threads, sort them concurrently and merge. The amount of threads, the chunks *
+* per thread and the grain size may be set by passing                          *
+* 'NaturalMergeSortOptions'.                                                   *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+void parallel_natural_merge_sort(RandomIt begin, RandomIt end, Cmp cmp)
+{
+    parallel_natural_merge_sort(begin, end, cmp, NaturalMergeSortOptions());
+}
+
+/*******************************************************************************
+* Sorts the range [begin, end) in parallel using the threads of 'pool' instead *
+* of spawning new ones. The calling thread takes part in sorting, so the sort  *
+* runs on at most 'pool.size() + 1' threads.                                   *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+void parallel_natural_merge_sort(RandomIt begin,
+                                 RandomIt end,
+                                 Cmp cmp,
+                                 ThreadPool& pool)
+{
+    NaturalMergeSortOptions options;
+    options.p_pool = &pool;
+    parallel_natural_merge_sort(begin, end, cmp, options);
+}
+
+/*******************************************************************************
+* Sorts the range [begin, end) in parallel as specified by 'options' by the    *
+* keys 'proj' projects the elements to, which are ordered by 'key_cmp'. If the *
+* keys are integers ordered by 'std::less', each chunk with many runs is radix *
+* sorted instead of merged.                                                    *
+*******************************************************************************/
+template<class RandomIt, class Proj, class KeyCmp>
+void parallel_natural_merge_sort_by_key(RandomIt begin,
+                                        RandomIt end,
+                                        Proj proj,
+                                        KeyCmp key_cmp,
+                                        const NaturalMergeSortOptions& options)
+{
+    parallel_natural_merge_sort(begin,
+                                end,
+                                make_projected_comparator(proj, key_cmp),
+                                options);
+}
+
+/*******************************************************************************
+* Sorts the range [begin, end) in parallel by the keys 'proj' projects the     *
+* elements to, which are ordered by 'std::less'.                               *
+*******************************************************************************/
+template<class RandomIt, class Proj>
+void parallel_natural_merge_sort_by_key(RandomIt begin, RandomIt end, Proj proj)
+{
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    typedef typename projected_key<Proj, value_type>::type key_type;
+    parallel_natural_merge_sort_by_key(begin,
+                                       end,
+                                       proj,
+                                       std::less<key_type>(),
+                                       NaturalMergeSortOptions());
+}
+
+/*******************************************************************************
+* Sorts the range [begin, end) with 'parallel_natural_merge_sort' as           *
+* specified by 'options'. Returns false if the sort stopped early because it   *
+* was cancelled, in which case the range holds its elements in an unspecified  *
+* order.                                                                       *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+bool run_parallel_natural_merge_sort(RandomIt begin,
+                                     RandomIt end,
+                                     Cmp cmp,
+                                     const NaturalMergeSortOptions& options)
+{
+    std::atomic<bool> stopped{false};
+    NaturalMergeSortOptions stop_options = options;
+    stop_options.p_stopped = &stopped;
+
+    parallel_natural_merge_sort(begin, end, cmp, stop_options);
+
+    if (!stopped.load())
+    {
+        return true;
+    }
+
+    if (options.p_stopped)
+    {
+        options.p_stopped->store(true);
+    }
+
+    return false;
+}
+
+/*******************************************************************************
+* Starts sorting the range [begin, end) with 'parallel_natural_merge_sort' as  *
+* specified by 'options' and returns at once. The sort runs in a thread of the *
+* pool 'options.p_pool', or in a new thread if it is null. The future becomes  *
+* true when the range is sorted, false if the sort stopped early because       *
+* 'options.p_cancel' was set, and holds the exception if the comparator threw  *
+* one in any thread of the sort, in which case the range holds valid but       *
+* unspecified elements. Destroying the future does not wait for the sort. The  *
+* range, the pool and the objects 'options' points to must outlive the sort.   *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+std::future<bool> parallel_natural_merge_sort_async(
+        RandomIt begin,
+        RandomIt end,
+        Cmp cmp,
+        const NaturalMergeSortOptions& options)
+{
+    std::shared_ptr<std::promise<bool>> p_promise =
+            std::make_shared<std::promise<bool>>();
+    std::future<bool> future = p_promise->get_future();
+
+    auto task = [begin, end, cmp, options, p_promise]()
+    {
+        try
+        {
+            p_promise->set_value(run_parallel_natural_merge_sort(begin,
+                                                                 end,
+                                                                 cmp,
+                                                                 options));
+        }
+        catch (...)
+        {
+            p_promise->set_exception(std::current_exception());
+        }
+    };
+
+    if (options.p_pool)
+    {
+        options.p_pool->submit(task);
+    }
+    else
+    {
+        // Unlike that of 'std::async', the future of a detached thread does
+        // not wait for the sort when it is destroyed.
+        std::thread(task).detach();
+    }
+
+    return future;
+}
+
+/*******************************************************************************
+* Starts sorting the range [begin, end) like the above with the default        *
+* options.                                                                     *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+std::future<bool> parallel_natural_merge_sort_async(RandomIt begin,
+                                                    RandomIt end,
+                                                    Cmp cmp)
+{
+    return parallel_natural_merge_sort_async(begin,
+                                             end,
+                                             cmp,
+                                             NaturalMergeSortOptions());
+}
+
+/*******************************************************************************
+* Sorts each of the ranges [first->first, first->second), ..., up to 'last'    *
+* independently as specified by 'options', using all the threads of the sort   *
+* on the whole batch. The ranges are given as pairs of iterators. A range      *
+* longer than the share of one thread of the batch is sorted with all the      *
+* threads by 'parallel_natural_merge_sort', one range after another. The rest  *
+* are packed into 'tasks_per_thread' bins per thread of about equal total      *
+* length, longest first onto the lightest bin, and each bin is sorted by a     *
+* single thread with 'natural_merge_sort', reusing one scratch buffer for all  *
+* of its ranges. The progress is reported per range sorted.                    *
+*******************************************************************************/
+template<class RangeIt, class Cmp>
+void parallel_natural_merge_sort_batch(RangeIt first,
+                                       RangeIt last,
+                                       Cmp cmp,
+                                       const NaturalMergeSortOptions& options)
+{
+    typedef typename std::iterator_traits<RangeIt>::value_type range_type;
+    typedef typename range_type::first_type RandomIt;
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+
+    const size_t range_amount = std::distance(first, last);
+    size_t total_length = 0;
+
+    for (RangeIt range = first; range != last; ++range)
+    {
+        total_length += std::distance(range->first, range->second);
+    }
+
+    const size_t grain_size = std::max(options.grain_size, (size_t) 1);
+    const size_t spawn = total_length / grain_size < 2 ? 1 :
+                         std::max((size_t) 1,
+                                  std::min(resolve_thread_count(options),
+                                           total_length / grain_size));
+
+    if (spawn > 1 && !options.p_pool)
+    {
+        // The calling thread is the last one.
+        ThreadPool pool(spawn - 1, options.numa_first_touch);
+        NaturalMergeSortOptions pooled_options = options;
+        pooled_options.p_pool = &pool;
+        parallel_natural_merge_sort_batch(first, last, cmp, pooled_options);
         return;
     }
 
-    const size_t left_quota = thread_quota / 2;
-    const size_t right_quota = thread_quota - left_quota;
-    const size_t left_length = length / 2;
+    // The ranges report the progress of the batch instead of their own.
+    NaturalMergeSortOptions range_options = options;
+    range_options.p_progress = nullptr;
+    sort_monitor monitor(options, range_amount);
 
-    if (thread_quota == 2)
+    const size_t huge_length = std::max(total_length / spawn, 2 * grain_size);
+    std::vector<RangeIt> small_ranges;
+
+    for (RangeIt range = first; range != last; ++range)
     {
-        
-#ifdef USE_POSIX_THREADS
-        
-        std::cout << "pthreads" << std::endl;
-        pthread_t thread_;
-        
-        data<RandomIt, Cmp> mydata;
-        mydata.source_begin = source;
-        mydata.source_end = source + left_length;
-        mydata.target_begin = target;
-        mydata.cmp = cmp;
-        
-        pthread_create(&thread_, 
-                       NULL, 
-                       (void* (*)(void*)) natural_merge_sort_thread_proxy<RandomIt, Cmp>,
-                       (void*) &mydata);
-#else // use std::thread
-        std::thread thread_(natural_merge_sort_impl<RandomIt, Cmp>,
-                            source,
-                            source + left_length,
-                            target,
-                            cmp);
+        if (spawn > 1 &&
+            (size_t) std::distance(range->first, range->second) >= huge_length)
+        {
+            if (!monitor.cancelled())
+            {
+                parallel_natural_merge_sort(range->first,
+                                            range->second,
+                                            cmp,
+                                            range_options);
+            }
+
+            monitor.advance();
+        }
+        else
+        {
+            small_ranges.push_back(range);
+        }
+    }
+
+    std::sort(small_ranges.begin(),
+              small_ranges.end(),
+              [](const RangeIt a, const RangeIt b)
+              {
+                  return std::distance(b->first, b->second) <
+                         std::distance(a->first, a->second);
+              });
+
+    // Keep the lightest bin on top of a heap of the bin loads. A batch too
+    // short for two threads is sorted in a single bin on the calling thread.
+    const size_t bin_amount =
+            std::min(small_ranges.size(),
+                     spawn == 1 ? 1 :
+                     spawn * std::max(options.tasks_per_thread, (size_t) 1));
+    std::vector<std::vector<RangeIt>> bins(bin_amount);
+    std::vector<std::pair<size_t, size_t>> loads;
+    std::greater<std::pair<size_t, size_t>> heavier;
+
+    for (size_t i = 0; i != bin_amount; ++i)
+    {
+        loads.push_back(std::make_pair((size_t) 0, i));
+    }
+
+    for (const RangeIt range : small_ranges)
+    {
+        std::pop_heap(loads.begin(), loads.end(), heavier);
+        loads.back().first += std::distance(range->first, range->second);
+        bins[loads.back().second].push_back(range);
+        std::push_heap(loads.begin(), loads.end(), heavier);
+    }
+
+    auto sort_bin = [&](const std::vector<RangeIt>& bin)
+    {
+        ScratchBuffer<value_type> scratch;
+
+        for (const RangeIt range : bin)
+        {
+            if (!monitor.cancelled())
+            {
+                natural_merge_sort(range->first,
+                                   range->second,
+                                   cmp,
+                                   scratch,
+                                   range_options);
+            }
+
+            monitor.advance();
+        }
+    };
+
+    TaskGroup group(options.p_pool);
+
+    for (size_t i = 1; i < bin_amount; ++i)
+    {
+        const std::vector<RangeIt>* p_bin = &bins[i];
+
+        group.run([&sort_bin, p_bin]()
+        {
+            sort_bin(*p_bin);
+        });
+    }
+
+    if (bin_amount > 0)
+    {
+        sort_bin(bins[0]);
+    }
+
+    group.wait();
+}
+
+/*******************************************************************************
+* Sorts each of the ranges [first->first, first->second), ..., up to 'last'    *
+* independently like the above with the default options.                       *
+*******************************************************************************/
+template<class RangeIt, class Cmp>
+void parallel_natural_merge_sort_batch(RangeIt first, RangeIt last, Cmp cmp)
+{
+    parallel_natural_merge_sort_batch(first,
+                                      last,
+                                      cmp,
+                                      NaturalMergeSortOptions());
+}
+
+#ifdef NATURAL_MERGE_SORT_COROUTINES
+/*******************************************************************************
+* Sorts a range with 'parallel_natural_merge_sort' when awaited in a           *
+* coroutine, which is suspended meanwhile and resumed in the thread that       *
+* finished the sort. The awaited value is that of the future of                *
+* 'parallel_natural_merge_sort_async', whose terms apply.                      *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+class ParallelNaturalMergeSortAwaitable {
+private:
+
+    RandomIt m_begin;
+    RandomIt m_end;
+    Cmp m_cmp;
+    NaturalMergeSortOptions m_options;
+    bool m_sorted;
+    std::exception_ptr m_exception;
+
+public:
+
+    ParallelNaturalMergeSortAwaitable(RandomIt begin,
+                                      RandomIt end,
+                                      Cmp cmp,
+                                      const NaturalMergeSortOptions& options) :
+    m_begin{begin},
+    m_end{end},
+    m_cmp(cmp),
+    m_options(options),
+    m_sorted{false}
+    {}
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle)
+    {
+        auto task = [this, handle]()
+        {
+            try
+            {
+                m_sorted = run_parallel_natural_merge_sort(m_begin,
+                                                           m_end,
+                                                           m_cmp,
+                                                           m_options);
+            }
+            catch (...)
+            {
+                m_exception = std::current_exception();
+            }
+
+            handle.resume();
+        };
+
+        if (m_options.p_pool)
+        {
+            m_options.p_pool->submit(task);
+        }
+        else
+        {
+            std::thread(task).detach();
+        }
+    }
+
+    bool await_resume()
+    {
+        if (m_exception)
+        {
+            std::rethrow_exception(m_exception);
+        }
+
+        return m_sorted;
+    }
+};
+
+/*******************************************************************************
+* Returns an awaitable sorting the range [begin, end) as specified by          *
+* 'options'.                                                                   *
+*******************************************************************************/
+template<class RandomIt, class Cmp>
+ParallelNaturalMergeSortAwaitable<RandomIt, Cmp>
+parallel_natural_merge_sort_awaitable(RandomIt begin,
+                                      RandomIt end,
+                                      Cmp cmp,
+                                      const NaturalMergeSortOptions& options)
+{
+    return ParallelNaturalMergeSortAwaitable<RandomIt, Cmp>(begin,
+                                                            end,
+                                                            cmp,
+                                                            options);
+}
 #endif
-        natural_merge_sort_impl(source + left_length, 
-                                source + length, 
-                                target + left_length, 
-                                cmp);
-        
-#ifdef USE_POSIX_THREADS
-        pthread_join(thread_, NULL);
-#else
-        thread_.join();
-#endif
-        std::merge(source, 
-                   source + left_length, 
-                   source + left_length, 
-                   source + length,
-                   target,
-                   cmp);
-        return;
+
+/*******************************************************************************
+* The execution policies of 'natural_merge_sort'. 'SequencedPolicy' sorts in   *
+* the calling thread. 'ParallelPolicy' sorts in parallel, but falls back to    *
+* the sequential sort for a range too short to give two threads a grain each,  *
+* so that the short sorts do not pay for the threads. Either may carry the     *
+* options of the sort; constructing a 'ParallelPolicy' from a pool and a grain *
+* size gives the custom policy running in that pool.                           *
+*                                                                              *
+* 'ParallelUnsequencedPolicy' runs like 'ParallelPolicy'. The branchless and   *
+* the vector merge kernels are chosen by the element type and the comparator   *
+* under every policy, as they do not change the output of the sorts.           *
+*******************************************************************************/
+struct SequencedPolicy {
+    NaturalMergeSortOptions options;
+
+    SequencedPolicy() {}
+
+    explicit SequencedPolicy(const NaturalMergeSortOptions& options) :
+    options(options)
+    {}
+};
+
+struct ParallelPolicy {
+    NaturalMergeSortOptions options;
+
+    ParallelPolicy() {}
+
+    explicit ParallelPolicy(const NaturalMergeSortOptions& options) :
+    options(options)
+    {}
+
+    explicit ParallelPolicy(ThreadPool& pool,
+                            const size_t grain_size = MINIMUM_THREAD_LOAD)
+    {
+        options.p_pool = &pool;
+        options.grain_size = grain_size;
     }
+};
 
-#ifdef USE_POSIX_THREADS
-    pthread_t left_thread;
-    
-    data2<RandomIt, Cmp> mydata;
-    mydata.target = target;
-    mydata.source = source;
-    mydata.length = left_length;
-    mydata.quota = left_quota;
-    mydata.cmp = cmp;
-    
-    pthread_create(&left_thread,
-                   NULL,
-                   (void* (*)(void*)) parallel_natural_merge_sort_thread_proxy<RandomIt, Cmp>,
-                   (void*) &mydata);
-#else
-    std::thread left_thread(parallel_natural_merge_sort_impl<RandomIt, Cmp>,
-                            target, 
-                            source, 
-                            left_length, 
-                            left_quota, 
-                            cmp);
+struct ParallelUnsequencedPolicy : ParallelPolicy {
+    using ParallelPolicy::ParallelPolicy;
+
+    ParallelUnsequencedPolicy() {}
+};
+
+/*******************************************************************************
+* Converts an execution policy to 'SequencedPolicy' or 'ParallelPolicy'. The   *
+* standard policies are converted too where the library provides them.         *
+*******************************************************************************/
+inline const SequencedPolicy& to_natural_merge_sort_policy(
+        const SequencedPolicy& policy)
+{
+    return policy;
+}
+
+inline const ParallelPolicy& to_natural_merge_sort_policy(
+        const ParallelPolicy& policy)
+{
+    return policy;
+}
+
+template<class Policy>
+struct is_natural_merge_sort_policy : std::integral_constant<bool,
+    std::is_same<Policy, SequencedPolicy>::value ||
+    std::is_same<Policy, ParallelPolicy>::value ||
+    std::is_same<Policy, ParallelUnsequencedPolicy>::value> {};
+
+#ifdef NATURAL_MERGE_SORT_STD_EXECUTION
+inline SequencedPolicy to_natural_merge_sort_policy(
+        const std::execution::sequenced_policy&)
+{
+    return SequencedPolicy();
+}
+
+inline ParallelPolicy to_natural_merge_sort_policy(
+        const std::execution::parallel_policy&)
+{
+    return ParallelPolicy();
+}
+
+inline ParallelPolicy to_natural_merge_sort_policy(
+        const std::execution::parallel_unsequenced_policy&)
+{
+    return ParallelPolicy();
+}
+
+#if __cpp_lib_execution >= 201902L
+inline SequencedPolicy to_natural_merge_sort_policy(
+        const std::execution::unsequenced_policy&)
+{
+    return SequencedPolicy();
+}
 #endif
 
-    parallel_natural_merge_sort_impl(target + left_length, 
-                                     source + left_length, 
-                                     length - left_length, 
-                                     right_quota, 
-                                     cmp);
-    // Wait for the left thread.
-#ifdef USE_POSIX_THREADS
-    pthread_join(left_thread, NULL);
+template<class Policy>
+struct is_execution_policy : std::integral_constant<bool,
+    is_natural_merge_sort_policy<Policy>::value ||
+    std::is_execution_policy<Policy>::value> {};
 #else
-    left_thread.join();
+template<class Policy>
+struct is_execution_policy : is_natural_merge_sort_policy<Policy> {};
 #endif
-    
-    // Merge the two chunks.
-    std::merge(source, 
-               source + left_length, 
-               source + left_length, 
-               source + length,
-               target,
-               cmp);
-    
+
+template<class RandomIt, class Cmp>
+void natural_merge_sort_with_policy(const SequencedPolicy& policy,
+                                    RandomIt first,
+                                    RandomIt last,
+                                    Cmp cmp)
+{
+    natural_merge_sort(first, last, cmp, policy.options);
+}
+
+template<class RandomIt, class Cmp>
+void natural_merge_sort_with_policy(const ParallelPolicy& policy,
+                                    RandomIt first,
+                                    RandomIt last,
+                                    Cmp cmp)
+{
+    const size_t length = std::distance(first, last);
+    const size_t grain_size =
+            std::max(policy.options.grain_size, (size_t) 1);
+
+    if (length / grain_size < 2 ||
+        resolve_thread_count(policy.options) < 2)
+    {
+        natural_merge_sort(first, last, cmp, policy.options);
+    }
+    else
+    {
+        parallel_natural_merge_sort(first, last, cmp, policy.options);
+    }
 }
 
 /*******************************************************************************
-* The actual parallel merge sort. If the system has N CPU cores, this sort     *     
-* will split the range into N chunks of equal length assuming that N is a      *
-* power of two, sort them concurrently and merge.                              *
+* Sorts the range [first, last) stably under the execution policy 'policy',    *
+* which is one of the policies above or, since C++17, a standard one such as   *
+* 'std::execution::par'.                                                       *
 *******************************************************************************/
-template<class RandomIt, class Cmp>
-void parallel_natural_merge_sort(RandomIt begin, RandomIt end, Cmp cmp)
+template<class Policy, class RandomIt, class Cmp>
+typename std::enable_if<
+    is_execution_policy<typename std::decay<Policy>::type>::value>::type
+natural_merge_sort(Policy&& policy, RandomIt first, RandomIt last, Cmp cmp)
 {
-    // At least 16384 elements per thread.
-    constexpr size_t MINIMUM_THREAD_LOAD = 1 << 14;
-    
-    const size_t cores = std::thread::hardware_concurrency();
-    const size_t length = std::distance(begin, end);
-    const size_t spawn = std::min(cores, length / MINIMUM_THREAD_LOAD);
-    
-    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
-    
-    RandomIt buffer = new value_type[length];
-    std::copy(begin, end, buffer);
-    parallel_natural_merge_sort_impl(buffer, begin, length, spawn, cmp);
+    natural_merge_sort_with_policy(to_natural_merge_sort_policy(policy),
+                                   first,
+                                   last,
+                                   cmp);
 }
 
-#ifdef USE_POSIX_THREADS
-template<class RandomIt, class Cmp>
-void* parallel_natural_merge_sort_thread_proxy(void* args)
+/*******************************************************************************
+* Sorts the range [first, last) stably under the execution policy 'policy' in  *
+* the order of 'std::less'.                                                    *
+*******************************************************************************/
+template<class Policy, class RandomIt>
+typename std::enable_if<
+    is_execution_policy<typename std::decay<Policy>::type>::value>::type
+natural_merge_sort(Policy&& policy, RandomIt first, RandomIt last)
 {
-    data2<RandomIt, Cmp>* p_data = (data2<RandomIt, Cmp>*) args;
-    parallel_natural_merge_sort_impl(p_data->target,
-                                     p_data->source,
-                                     p_data->length,
-                                     p_data->quota,
-                                     p_data->cmp);
-    return nullptr;
+    typedef typename std::iterator_traits<RandomIt>::value_type value_type;
+    natural_merge_sort(std::forward<Policy>(policy),
+                       first,
+                       last,
+                       std::less<value_type>());
 }
 #endif
-#endif